@@ -20,10 +20,13 @@
 #define BITBOARD_H
 
 #include <cmath>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "data.h"
 
-inline int count(Bitboard b) { return __builtin_popcountll(b); }
+constexpr int count(Bitboard b) { return __builtin_popcountll(b); }
 
 inline Square lsb(Bitboard b) { assert(b != 0); return (Square)(__builtin_ctzll(b)); }
 inline Square msb(Bitboard b) { assert(b != 0); return (Square)(63 ^ __builtin_clzll(b)); }
@@ -52,14 +55,53 @@ inline bool only_one(Bitboard b) {
   return b && !more_than_one(b);
 }
 
-inline Bitboard shift(Bitboard b, int offset) {
-    if (offset > 0) {
-        return b << offset;
-    }
-    return b >> -offset;
+// A white and a black bitboard side by side, white in lane 0, so that the
+// evaluation does the mask work of both colors in one go. Forward shifts move
+// the white lane up the board and the black lane down.
+#if defined(__SSE2__)
+typedef __m128i ColorPair;
+
+inline ColorPair color_pair(Bitboard w, Bitboard b) { return _mm_set_epi64x(int64_t(b), int64_t(w)); }
+inline ColorPair load_pair(const Bitboard *bbs) { return _mm_loadu_si128((const __m128i *) bbs); }
+inline void store_pair(Bitboard *bbs, ColorPair v) { _mm_storeu_si128((__m128i *) bbs, v); }
+inline ColorPair flip_colors(ColorPair v) { return _mm_shuffle_epi32(v, 0x4E); }
+
+#if defined(__AVX2__)
+// Shifts of 64 clear the lane going the other way
+template<int N> inline ColorPair shift_forward(ColorPair v) {
+    return _mm_or_si128(_mm_sllv_epi64(v, _mm_set_epi64x(64, N)), _mm_srlv_epi64(v, _mm_set_epi64x(N, 64)));
+}
+template<int N> inline ColorPair shift_backward(ColorPair v) {
+    return _mm_or_si128(_mm_srlv_epi64(v, _mm_set_epi64x(64, N)), _mm_sllv_epi64(v, _mm_set_epi64x(N, 64)));
+}
+#else
+// SSE2 shifts both lanes the same way, shift both ways and pick each lane
+template<int N> inline ColorPair shift_forward(ColorPair v) {
+    const __m128i white_lane = _mm_set_epi64x(0, -1);
+    return _mm_or_si128(_mm_and_si128(white_lane, _mm_slli_epi64(v, N)), _mm_andnot_si128(white_lane, _mm_srli_epi64(v, N)));
 }
+template<int N> inline ColorPair shift_backward(ColorPair v) {
+    const __m128i white_lane = _mm_set_epi64x(0, -1);
+    return _mm_or_si128(_mm_and_si128(white_lane, _mm_srli_epi64(v, N)), _mm_andnot_si128(white_lane, _mm_slli_epi64(v, N)));
+}
+#endif
+
+#else
+typedef Bitboard ColorPair __attribute__((vector_size(16)));
+
+inline ColorPair color_pair(Bitboard w, Bitboard b) { return ColorPair{w, b}; }
+inline ColorPair load_pair(const Bitboard *bbs) { return ColorPair{bbs[0], bbs[1]}; }
+inline void store_pair(Bitboard *bbs, ColorPair v) { bbs[0] = v[0]; bbs[1] = v[1]; }
+inline ColorPair flip_colors(ColorPair v) { return ColorPair{v[1], v[0]}; }
+
+template<int N> inline ColorPair shift_forward(ColorPair v) { return ColorPair{v[0] << N, v[1] >> N}; }
+template<int N> inline ColorPair shift_backward(ColorPair v) { return ColorPair{v[0] >> N, v[1] << N}; }
+#endif
+
+inline Bitboard lane(ColorPair v, Color color) { return Bitboard(v[int(color)]); }
 
-Bitboard reverse(Bitboard a);
-Bitboard trim(Bitboard b, int r, int f);
+// Pawn attacks of both colors, to the left and to the right as each side sees the board
+inline ColorPair pawn_threats_left(ColorPair pawns) { return shift_forward<7>(pawns & color_pair(~FILE_ABB, ~FILE_HBB)); }
+inline ColorPair pawn_threats_right(ColorPair pawns) { return shift_forward<9>(pawns & color_pair(~FILE_HBB, ~FILE_ABB)); }
 
 #endif
@@ -21,7 +21,11 @@
 
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 typedef int8_t Square;
 typedef uint64_t Bitboard;
@@ -36,11 +40,15 @@ inline Color& operator++(Color& c) { return c = Color(int(c) + 1); }
 inline Color& operator--(Color& c) { return c = Color(int(c) - 1); }
 inline Color operator~(Color c) { return Color(c ^ 1); }
 
+#ifdef __TUNE__
+// The tuner changes each half of a parameter through an int pointer
 typedef struct Score {
     int midgame;
     int endgame;
 
-    Score(int x=0, int y=0) : midgame(x), endgame(y)
+    constexpr Score() : midgame(0), endgame(0)
+    {}
+    constexpr Score(int x, int y) : midgame(x), endgame(y)
     {}
 
     inline Score operator+(const Score& a) const
@@ -51,68 +59,74 @@ typedef struct Score {
     {
         return Score(midgame - a.midgame, endgame - a.endgame);
     }
-    inline Score operator+=(const Score& a) 
+    inline Score operator+=(const Score& a)
     {
         this->midgame += a.midgame;
         this->endgame += a.endgame;
         return *this;
     }
-    inline Score operator-=(const Score& a) 
-    {        
+    inline Score operator-=(const Score& a)
+    {
         this->midgame -= a.midgame;
         this->endgame -= a.endgame;
         return *this;
     }
-    inline Score operator/(const Score& a) const
-    {
-        return Score(midgame / a.midgame, endgame / a.endgame);
-    }
-    inline Score operator*(const Score& a) const
+    inline Score operator*(const int& a) const
     {
-        return Score(midgame * a.midgame, endgame * a.endgame);
+        return Score(midgame * a, endgame * a);
     }
-    inline Score operator+=(const int& a) 
+} Score;
+
+inline int mg_value(Score s) { return s.midgame; }
+inline int eg_value(Score s) { return s.endgame; }
+#else
+// Endgame in the upper and midgame in the lower 16 bits of one int, so a
+// single add, subtract or multiply updates both halves. Both halves must stay
+// within int16_t.
+typedef struct Score {
+    int value;
+
+    constexpr Score() : value(0)
+    {}
+    constexpr Score(int x, int y) : value(int((unsigned int) y << 16) + x)
+    {}
+
+    inline Score operator+(const Score& a) const
     {
-        this->midgame += a;
-        this->endgame += a;
-        return *this;
+        return from_value(value + a.value);
     }
-    inline Score operator-=(const int& a)
+    inline Score operator-(const Score& a) const
     {
-        this->midgame -= a;
-        this->endgame -= a;
-        return *this;
+        return from_value(value - a.value);
     }
-    inline Score operator*=(const int& a)
+    inline Score operator+=(const Score& a)
     {
-        this->midgame *= a;
-        this->endgame *= a;
+        this->value += a.value;
         return *this;
     }
-    inline Score operator/=(const int& a)
+    inline Score operator-=(const Score& a)
     {
-        this->midgame /= a;
-        this->endgame /= a;
+        this->value -= a.value;
         return *this;
     }
-    inline Score operator+(const int& a) const
-    {
-        return Score(midgame + a, endgame + a);
-    }
-    inline Score operator-(const int& a) const
-    {
-        return Score(midgame - a, endgame - a);
-    }
-    inline Score operator/(const int& a) const
+    inline Score operator*(const int& a) const
     {
-        return Score(midgame / a, endgame / a);
+        return from_value(value * a);
     }
-    inline Score operator*(const int& a) const
+
+    static inline Score from_value(int v)
     {
-        return Score(midgame * a, endgame * a);
+        Score s;
+        s.value = v;
+        return s;
     }
 } Score;
 
+inline int mg_value(Score s) { return int16_t(uint16_t(unsigned(s.value))); }
+// A negative midgame half borrows one from the endgame half, rounding undoes it
+inline int eg_value(Score s) { return int16_t(uint16_t((unsigned(s.value) + 0x8000) >> 16)); }
+#endif
+
 typedef struct Position Position;
 typedef struct MoveGen MoveGen;
 typedef struct SearchThread SearchThread;
@@ -135,7 +149,7 @@ const Bitboard FILE_FBB = FILE_ABB << 5;
 const Bitboard FILE_GBB = FILE_ABB << 6;
 const Bitboard FILE_HBB = FILE_ABB << 7;
 
-const Bitboard FILE_MASK[8] = {
+constexpr Bitboard FILE_MASK[8] = {
     FILE_ABB, FILE_BBB, FILE_CBB, FILE_DBB, FILE_EBB, FILE_FBB, FILE_GBB, FILE_HBB
 };
 
@@ -164,18 +178,18 @@ const Bitboard RANK_6BB = 0x0000FF0000000000;
 const Bitboard RANK_7BB = 0x00FF000000000000;
 const Bitboard RANK_8BB = 0xFF00000000000000;
 
-const Bitboard RANK_MASK[8] = {
+constexpr Bitboard RANK_MASK[8] = {
     RANK_1BB, RANK_2BB, RANK_3BB, RANK_4BB, RANK_5BB, RANK_6BB, RANK_7BB, RANK_8BB
 };
 
-const uint64_t cross_lt[15] = {
+constexpr uint64_t cross_lt[15] = {
     0x0000000000000001, 0x0000000000000102, 0x0000000000010204, 0x0000000001020408,
     0x0000000102040810, 0x0000010204081020, 0x0810204080000000, 0x0001020408102040,
     0x0102040810204080, 0x0204081020408000, 0x0408102040800000, 0x1020408000000000,
     0x2040800000000000, 0x4080000000000000, 0x8000000000000000
 };
 
-const uint64_t cross_rt[15] = {
+constexpr uint64_t cross_rt[15] = {
     0x0100000000000000, 0x0201000000000000, 0x0402010000000000, 0x0804020100000000,
     0x1008040201000000, 0x2010080402010000, 0x4020100804020100, 0x8040201008040201,
     0x0080402010080402, 0x0000804020100804, 0x0000008040201008, 0x0000000080402010,
@@ -281,6 +295,10 @@ enum _Square : Square {
 
 const char piece_chars[NUM_PIECE] = {'\0', '\0', '\0', '\0', 'N', 'n', 'B', 'b', 'R', 'r', 'Q', 'q', 'K', 'k'};
 
+#ifdef __NNUE__
+const int NNUE_HIDDEN = 256; // Accumulator size of each side
+#endif
+
 typedef struct Info {
     // COPIED 
     uint64_t pawn_hash;
@@ -294,6 +312,11 @@ typedef struct Info {
     Bitboard pinned[2];
     Piece    captured;
     Info     *previous;
+#ifdef __NNUE__
+    // First layer of the network from white's and black's point of view,
+    // written by make_move from the previous ply so undo_move just drops it
+    alignas(32) int16_t accumulator[2][NNUE_HIDDEN];
+#endif
 } Info;
 
 typedef struct CopiedInfo {
@@ -307,6 +330,12 @@ typedef struct CopiedInfo {
 
 const int info_size = sizeof(CopiedInfo);
 
+// Continuation history, [previous piece][previous to][piece][to] flattened
+const int cmh_table_size = NUM_PIECE * 64;
+const int cmh_size = NUM_PIECE * 64 * cmh_table_size;
+
+inline int cmh_index(Piece piece, Square to) { return piece * 64 + to; }
+
 typedef struct Metadata {
     int  ply;
     Move current_move;
@@ -314,7 +343,7 @@ typedef struct Metadata {
     Move killers[2];
     Move pv[MAX_PLY + 1];
     Move excluded_move;
-    int  **counter_move_history;
+    int16_t *counter_move_history; // The table of the previous move, indexed by cmh_index
 } Metadata;
 
 enum RookSquares {
@@ -335,7 +364,7 @@ struct Position {
     uint8_t      CASTLING_RIGHTS[64];
 };
 
-const uint64_t pawntt_size = 16384ULL;
+const int evalcache_size = 8192; // Entries per thread, a power of 2
 
 typedef struct PawnTTEntry {
     uint64_t pawn_hash;
@@ -394,14 +423,6 @@ enum SearchType {
     PROBCUT_SEARCH = 2
 };
 
-typedef struct ScoredMove {
-    Move move;
-    int  score;
-} ScoredMove;
-
-bool scored_move_compare(ScoredMove lhs, ScoredMove rhs);
-bool scored_move_compare_greater(ScoredMove lhs, ScoredMove rhs);
-
 enum Stages {
     // Regular stages
     NORMAL_TTE_MOVE = 0,
@@ -439,8 +460,17 @@ enum ScoreType {
     SCORE_EVASION = 2
 };
 
+// 218 is the most legal moves known in a position, the rest leaves room for
+// pseudo legal king and pinned piece moves. append_move asserts the bound.
+const int MAX_GEN_MOVES = 224;
+static_assert(MAX_GEN_MOVES >= 218, "MoveGen must hold every legal move");
+static_assert(MAX_GEN_MOVES <= 255, "MoveGen::tail is a uint8_t");
+
+// Moves and scores live in separate arrays and are left uninitialized, only
+// the entries between head and tail are ever read
 struct MoveGen {
-    ScoredMove moves[256];
+    Move       moves[MAX_GEN_MOVES];
+    int        scores[MAX_GEN_MOVES];
     Position   *position;
     Move       tte_move;
     Move       counter_move;
@@ -451,17 +481,33 @@ struct MoveGen {
     int        threshold;
 };
 
-const MoveGen blank_movegen = {
-    {}, // Moves
-    nullptr, // Position
-    no_move, // tte_move
-    no_move, // counter move
-    0, // stage
-    0, // head
-    0, // tail
-    0, // end bad captures
-    0 // threshold
-};
+const int tt_depth_bands = 5; // qsearch, 1-4, 5-8, 9-12, 13+
+const int tt_age_bands = 4;   // current search, 1, 2, 3+ searches old
+const int lazy_eval_stages = 3; // king safety, threats, passers
+
+typedef struct TTStats {
+    uint64_t fresh_writes; // entries that became part of the current generation
+    uint64_t probes[tt_depth_bands];
+    uint64_t hits[tt_depth_bands];
+    uint64_t collisions;   // hits whose move isn't pseudolegal in the position
+    uint64_t replacements[tt_age_bands][tt_depth_bands]; // by age and depth of the overwritten entry
+    uint64_t pawn_probes;
+    uint64_t pawn_hits;
+    uint64_t eval_probes;
+    uint64_t eval_hits;
+    uint64_t lazy_evals;                  // evaluations outside the window after the pieces
+    uint64_t lazy_cuts[lazy_eval_stages]; // by the first stage that was skipped
+} TTStats;
+
+const int MAX_MOVES = 256;
+
+typedef struct RootMove {
+    Move move;
+    int  score;          // Exact or lower bound for the lines searched, -MATE otherwise
+    int  previous_score; // Score at the previous depth, centers the aspiration window
+    uint64_t nodes;      // Spent in this move's subtree over all iterations
+    Move pv[MAX_PLY + 1];
+} RootMove;
 
 struct SearchThread {
     Position    position;
@@ -471,13 +517,36 @@ struct SearchThread {
     int         search_ply;
     Metadata    metadatas[MAX_PLY + 2];
     Move        counter_moves[NUM_PIECE][64];
-    int         history[2][64][64];
-    int         **counter_move_history[NUM_PIECE][64];
+    int         (*history)[64][64];  // Either own_history or the shared table
+    int         own_history[2][64][64];
+    int16_t     *counter_move_history; // cmh_size entries, cache line aligned
     int         selply;
-    PawnTTEntry pawntt[pawntt_size];
-    uint64_t    nodes;
+    int         completed_depth; // Last finished iteration, used to vote for the best move
+    int         completed_score;
+    Move        completed_pv[MAX_PLY + 1];
+    RootMove    root_moves[MAX_MOVES];
+    int         root_move_count;
+    int         pv_index;        // MultiPV line being searched
+    PawnTTEntry *pawntt;
+    uint64_t    pawntt_mask;
+    uint64_t    evalcache[evalcache_size]; // Upper 48 bits of the hash, then the eval
+    // Read by the other threads, kept on a cache line of their own
+    alignas(64) uint64_t nodes;
     uint64_t    tb_hits;
+
+    alignas(64) TTStats tt_stats;
     bool        nmp_enabled;
+
+    // Worker state, the thread sleeps on sleep_condition between searches
+    std::thread             native_thread;
+    std::mutex              mutex;
+    std::condition_variable sleep_condition;
+    bool                    searching;
+    bool                    exiting;
+    std::function<void()>   job;           // Work other than a search, run once when set
+    int                     start_latency; // microseconds from go until the search started
+    bool                    scheduled;     // Still taking turns in deterministic mode
+    int                     turn_count;    // Nodes left in this turn
 };
 
 const int MAX_THREADS = 256;
@@ -27,60 +27,31 @@
 #include <cstdlib>
 
 #include "const.h"
+#include "masks.h"
 #include "params.h"
 
-extern Bitboard BISHOP_MASKS_1[64];
-extern Bitboard BISHOP_MASKS_2[64];
-extern Bitboard BISHOP_MASKS_COMBINED[64];
-extern Bitboard ROOK_MASKS_HORIZONTAL[64];
-extern Bitboard ROOK_MASKS_VERTICAL[64];
-extern Bitboard ROOK_MASKS_COMBINED[64];
-extern Bitboard KNIGHT_MASKS[64];
-extern Bitboard KING_MASKS[64];
-extern Bitboard KING_EXTENDED_MASKS[2][64];
-extern Bitboard bfi[65];
-extern Bitboard bfi_queen_castle[2];
-extern Bitboard bfi_king_castle[2];
-extern Bitboard PAWN_ADVANCE_MASK_1[64][2];
-extern Bitboard PAWN_ADVANCE_MASK_2[64][2];
-extern Bitboard PAWN_CAPTURE_MASK[64][2];
-extern Bitboard BETWEEN_MASK[64][64];
-extern Bitboard BETWEEN_MASK_INCLUSIVE[64][64];
-extern Bitboard FROMTO_MASK[64][64];
-extern Bitboard PASSED_PAWN_MASK[64][2];
-extern Bitboard FRONT_MASK[64][2];
-extern Bitboard ADJACENT_MASK[64];
-extern Bitboard DISTANCE_RING[64][8];
-extern Bitboard FRONT_RANK_MASKS[64][8];
-
-extern Square ENPASSANT_INDEX[64];
 extern uint64_t castling_hash[16];
 
-extern int CASTLE_TYPE[64];
-extern Square ROOK_MOVES_CASTLE_TO[64];
-
 void init();
 void init_imbalance();
 extern int ours[5][5];
 extern int theirs[5][5];
 extern int pawn_set[9];
 
-extern int mvvlva_values[12][NUM_PIECE];
+extern int mvvlva_values[NUM_PIECE][NUM_PIECE];
 
 extern Material material_base[9*3*3*3*2*9*3*3*3*2];
 
 inline Material *get_material(Position *p) { return &material_base[p->info->material_index]; }
-inline PawnTTEntry *get_pawntte(Position *p) { return &p->my_thread->pawntt[p->info->pawn_hash & (pawntt_size - 1)]; }
-
-bool scored_move_compare(ScoredMove lhs, ScoredMove rhs);
-bool scored_move_compare_greater(ScoredMove lhs, ScoredMove rhs);
+inline int16_t *cmh_table(SearchThread *t, Piece piece, Square to) { return t->counter_move_history + cmh_index(piece, to) * cmh_table_size; }
+inline PawnTTEntry *get_pawntte(Position *p) { return &p->my_thread->pawntt[p->info->pawn_hash & p->my_thread->pawntt_mask]; }
 
 inline bool is_main_thread(Position *p) {return p->my_thread->thread_id == 0;}
 
 extern SearchThread main_thread;
-extern SearchThread *search_threads;
+extern SearchThread **search_threads;
 
-inline SearchThread *get_thread(int thread_id) { return thread_id == 0 ? &main_thread : &search_threads[thread_id - 1]; }
+inline SearchThread *get_thread(int thread_id) { return thread_id == 0 ? &main_thread : search_threads[thread_id - 1]; }
 
 extern int num_threads;
 extern int move_overhead;
@@ -148,9 +119,6 @@ inline Square move_to(Move m) {return (m >> 4) & 63;}
 // Both no_move and null_move have the same from/to values
 inline bool is_move_valid(Move m) {return move_from(m) != move_to(m);}
 
-inline int rank_of(Square s) {return s >> 3;}
-inline int file_of(Square s) {return s & 7;}
-
 inline int relative_rank(Square s, Color color) {return rank_of(s) ^ (color * 7);}
 
 inline int distance(Square s1, Square s2) {
@@ -16,9 +16,13 @@
     along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <iomanip>
+#include <iostream>
+
 #include "eval.h"
 #include "bitboard.h"
 #include "move.h"
+#include "nnue.h"
 #include "target.h"
 #include "tt.h"
 
@@ -107,6 +111,7 @@ void pawn_shelter_with_castling(Evaluation *eval, Position *p, Color color) {
 }
 
 void evaluate_pawns(Evaluation *eval, Position *p) {
+    ++p->my_thread->tt_stats.pawn_probes;
     if (eval->pawntte->pawn_hash != p->info->pawn_hash) {
         eval->pawntte->pawn_hash = p->info->pawn_hash;
 
@@ -120,6 +125,7 @@ void evaluate_pawns(Evaluation *eval, Position *p) {
         pawn_shelter_with_castling(eval, p, white);
         pawn_shelter_with_castling(eval, p, black);
     } else {
+        ++p->my_thread->tt_stats.pawn_hits;
         if (p->king_index[white] != eval->pawntte->king_index[white] ||
                 (p->info->castling & can_castle_mask[white]) != (eval->pawntte->castling & can_castle_mask[white])) {
             pawn_shelter_with_castling(eval, p, white);
@@ -145,7 +151,6 @@ Score evaluate_pieces(Evaluation *eval, Position *p, Color color) {
     Bitboard my_knights = p->bbs[knight(color)];
     Bitboard my_rooks = p->bbs[rook(color)];
     Bitboard my_queens = p->bbs[queen(color)];
-    Bitboard pinned = p->info->pinned[color];
 
     Bitboard opponent_bishops = p->bbs[bishop(~color)];
     Bitboard opponent_knights = p->bbs[knight(~color)];
@@ -155,10 +160,7 @@ Score evaluate_pieces(Evaluation *eval, Position *p, Color color) {
     eval->targets[bishop(color)] = 0;
     while (my_bishops) {
         Square sq = pop(&my_bishops);
-        Bitboard bishop_targets = generate_bishop_targets(p->board ^ p->bbs[queen(color)], sq);
-        if (pinned & bfi[sq]) {
-            bishop_targets &= FROMTO_MASK[p->king_index[color]][sq];
-        }
+        Bitboard bishop_targets = generate_bishop_targets(p->board ^ p->bbs[queen(color)], sq) & pin_mask(p, color, sq);
 
         capturable = opponent_bishops | opponent_rooks | opponent_queens;
         int mobility = count(bishop_targets & (eval->mobility_area[color] | capturable));
@@ -181,12 +183,8 @@ Score evaluate_pieces(Evaluation *eval, Position *p, Color color) {
     eval->targets[knight(color)] = 0;
     while (my_knights) {
         Square sq = pop(&my_knights);
-        Bitboard knight_targets = generate_knight_targets(sq);
-
-        if (pinned & bfi[sq]) {
-            // Pinned knights cannot move
-            knight_targets = 0;
-        }
+        // Pinned knights cannot move, none of their targets are on the pin line
+        Bitboard knight_targets = generate_knight_targets(sq) & pin_mask(p, color, sq);
 
         capturable = opponent_knights | opponent_bishops | opponent_rooks | opponent_queens;
         int mobility = count(knight_targets & (eval->mobility_area[color] | capturable));
@@ -206,11 +204,7 @@ Score evaluate_pieces(Evaluation *eval, Position *p, Color color) {
     eval->targets[rook(color)] = 0;
     while (my_rooks) {
         Square sq = pop(&my_rooks);
-        Bitboard rook_targets = generate_rook_targets(p->board ^ (p->bbs[queen(color)] | p->bbs[rook(color)]), sq);
-
-        if (pinned & bfi[sq]) {
-            rook_targets &= FROMTO_MASK[p->king_index[color]][sq];
-        }
+        Bitboard rook_targets = generate_rook_targets(p->board ^ (p->bbs[queen(color)] | p->bbs[rook(color)]), sq) & pin_mask(p, color, sq);
 
         capturable = opponent_rooks | opponent_queens;
         int mobility = count(rook_targets & (eval->mobility_area[color] | capturable));
@@ -235,11 +229,7 @@ Score evaluate_pieces(Evaluation *eval, Position *p, Color color) {
     eval->targets[queen(color)] = 0;
     while (my_queens) {
         Square sq = pop(&my_queens);
-        Bitboard queen_targets = generate_queen_targets(p->board, sq);
-
-        if (pinned & bfi[sq]) {
-            queen_targets &= FROMTO_MASK[p->king_index[color]][sq];
-        }
+        Bitboard queen_targets = generate_queen_targets(p->board, sq) & pin_mask(p, color, sq);
 
         capturable = opponent_queens;
         int mobility = count(queen_targets & (eval->mobility_area[color] | capturable));
@@ -265,17 +255,17 @@ Score evaluate_king(Evaluation *eval, Position *p, Color color) {
     Square king_sq = p->king_index[color];
 
     int pawn_shelter_value = eval->pawntte->pawn_shelter_value[color];
-    king_score.midgame += pawn_shelter_value;
+    king_score += Score{pawn_shelter_value, 0};
 
     if (p->bbs[pawn(color)]) {
         int pawn_distance = 0;
         while (!(DISTANCE_RING[king_sq][pawn_distance++] & p->bbs[pawn(color)])) {}
-        king_score.endgame -= pawn_distance_penalty * pawn_distance;
+        king_score -= Score{0, pawn_distance_penalty * pawn_distance};
     }
 
     Bitboard flank_attacks = eval->targets[~color] & flank_ranks[color] & flank_files[file_of(king_sq)];
     Bitboard flank_attacks2 = flank_attacks & eval->double_targets[~color];
-    king_score.midgame -= king_flank_penalty * (count(flank_attacks) + count(flank_attacks2));
+    king_score -= Score{king_flank_penalty * (count(flank_attacks) + count(flank_attacks2)), 0};
 
     if (eval->num_king_attackers[color] > (1 - eval->num_queens[~color])) {
         Bitboard weak = eval->targets[king(color)] & eval->targets[~color] & ~eval->double_targets[color];
@@ -354,14 +344,22 @@ Score evaluate_threat(Evaluation *eval, Position *p, Color color) {
         }
     }
 
-    Bitboard pawn_moves  = (color == white ? p->bbs[pawn(color)] << 8 : p->bbs[pawn(color)] >> 8) & ~p->board;
-    pawn_moves |= (color == white ? ((pawn_moves & RANK_3BB) << 8) : ((pawn_moves & RANK_6BB) >> 8)) & ~p->board;
-    pawn_moves &= ~eval->targets[pawn(~color)] & (eval->targets[color] | ~eval->targets[~color]);
-    threat_score += pawn_push_threat_bonus * count(generate_pawn_threats(pawn_moves, color) & p->bbs[~color]);
-
     return threat_score;
 }
 
+Score evaluate_pawn_push_threats(Evaluation *eval, Position *p) {
+    // Safe pawn pushes that attack a piece, for both colors at once
+    ColorPair empty = ~color_pair(p->board, p->board);
+    ColorPair targets = load_pair(&eval->targets[white]);
+
+    ColorPair pawn_moves = shift_forward<8>(load_pair(&p->bbs[white_pawn])) & empty;
+    pawn_moves |= shift_forward<8>(pawn_moves & color_pair(RANK_3BB, RANK_6BB)) & empty;
+    pawn_moves &= ~flip_colors(load_pair(&eval->targets[white_pawn])) & (targets | ~flip_colors(targets));
+
+    ColorPair threats = (pawn_threats_left(pawn_moves) | pawn_threats_right(pawn_moves)) & flip_colors(load_pair(&p->bbs[white]));
+    return pawn_push_threat_bonus * (count(lane(threats, white)) - count(lane(threats, black)));
+}
+
 Score evaluate_passers(Evaluation *eval, Position *p, Color color) {
     Score passer_score = {0, 0};
     Bitboard passers = eval->pawntte->pawn_passers[color];
@@ -372,8 +370,8 @@ Score evaluate_passers(Evaluation *eval, Position *p, Color color) {
         int r = relative_rank(sq, color);
         passer_score += passed_pawn_bonus[r];
 
-        passer_score.endgame -= passer_my_distance[r] * distance(p->king_index[color], sq);
-        passer_score.endgame += passer_enemy_distance[r] * distance(p->king_index[~color], sq);
+        passer_score += Score{0, passer_enemy_distance[r] * distance(p->king_index[~color], sq)
+                               - passer_my_distance[r] * distance(p->king_index[color], sq)};
 
         blocked = bool(bfi[pawn_forward(sq, color)] & p->board);
         unsafe = bool(bfi[pawn_forward(sq, color)] & eval->targets[~color]);
@@ -388,21 +386,17 @@ Score evaluate_passers(Evaluation *eval, Position *p, Color color) {
 void pre_eval(Evaluation *eval, Position *p) {
     eval->pawntte = get_pawntte(p);
 
-    eval->targets[white_pawn] = generate_pawn_threats(p->bbs[white_pawn], white);
-    eval->targets[black_pawn] = generate_pawn_threats(p->bbs[black_pawn], black);
-    eval->targets[white_king] = generate_king_targets(p->king_index[white]);
-    eval->targets[black_king] = generate_king_targets(p->king_index[black]);
-    eval->targets[white] = 0;
-    eval->targets[black] = 0;
-
-    eval->double_targets[white] = ((p->bbs[white_pawn] & ~FILE_ABB) << 7) & ((p->bbs[white_pawn] & ~FILE_HBB) << 9);
-    eval->double_targets[black] = ((p->bbs[black_pawn] & ~FILE_HBB) >> 7) & ((p->bbs[black_pawn] & ~FILE_ABB) >> 9);
-
-    eval->double_targets[white] |= eval->targets[white_king] & eval->targets[white_pawn];
-    eval->double_targets[black] |= eval->targets[black_king] & eval->targets[black_pawn];
+    // White and black are done together in the lanes of a ColorPair
+    ColorPair pawns = load_pair(&p->bbs[white_pawn]);
+    ColorPair left_targets = pawn_threats_left(pawns);
+    ColorPair right_targets = pawn_threats_right(pawns);
+    ColorPair pawn_targets = left_targets | right_targets;
+    ColorPair king_targets = color_pair(generate_king_targets(p->king_index[white]), generate_king_targets(p->king_index[black]));
 
-    eval->targets[white] = eval->targets[white_king] | eval->targets[white_pawn];
-    eval->targets[black] = eval->targets[black_king] | eval->targets[black_pawn];
+    store_pair(&eval->targets[white_pawn], pawn_targets);
+    store_pair(&eval->targets[white_king], king_targets);
+    store_pair(eval->double_targets, (left_targets & right_targets) | (king_targets & pawn_targets));
+    store_pair(&eval->targets[white], king_targets | pawn_targets);
 
     if (relative_rank(p->king_index[white], white) == RANK_1) {
         eval->king_zone[white] = KING_EXTENDED_MASKS[white][p->king_index[white]];
@@ -416,16 +410,13 @@ void pre_eval(Evaluation *eval, Position *p) {
         eval->king_zone[black] = eval->targets[black_king];
     }
 
-    eval->num_king_attackers[white] = count(eval->targets[black_pawn] & eval->king_zone[white]);
-    eval->num_king_attackers[black] = count(eval->targets[white_pawn] & eval->king_zone[black]);
+    ColorPair king_zone_attacks = flip_colors(pawn_targets) & load_pair(eval->king_zone);
+    eval->num_king_attackers[white] = count(lane(king_zone_attacks, white));
+    eval->num_king_attackers[black] = count(lane(king_zone_attacks, black));
 
-    Bitboard low_ranks= RANK_2BB | RANK_3BB;
-    Bitboard blocked_pawns= p->bbs[pawn(white)] & ((p->board >> 8) | low_ranks);
-    eval->mobility_area[white] = ~(blocked_pawns | p->bbs[white_king] | eval->targets[black_pawn]);
-
-    low_ranks = RANK_6BB | RANK_7BB;
-    blocked_pawns = p->bbs[pawn(black)] & ((p->board << 8) | low_ranks);
-    eval->mobility_area[black] = ~(blocked_pawns | p->bbs[black_king] | eval->targets[white_pawn]);
+    ColorPair low_ranks = color_pair(RANK_2BB | RANK_3BB, RANK_6BB | RANK_7BB);
+    ColorPair blocked_pawns = pawns & (shift_backward<8>(color_pair(p->board, p->board)) | low_ranks);
+    store_pair(eval->mobility_area, ~(blocked_pawns | load_pair(&p->bbs[white_king]) | flip_colors(pawn_targets)));
 
     eval->num_king_zone_attacks[white] = eval->num_king_zone_attacks[black] = 0;
     eval->king_zone_score[white] = eval->king_zone_score[black] = 0;
@@ -443,7 +434,7 @@ int scaling_factor(Position *p) {
         }
     }
 
-    Color winner = p->score.endgame > 0 ? white : black;
+    Color winner = eg_value(p->score) > 0 ? white : black;
     if (!p->bbs[pawn(winner)] && p->info->non_pawn_material[winner] <= p->info->non_pawn_material[~winner] + piece_values[white_bishop]) {
         return SCALE_NO_PAWNS;
     }
@@ -451,8 +442,102 @@ int scaling_factor(Position *p) {
     return SCALE_NORMAL;
 }
 
-int evaluate(Position *p) {
-    assert(!is_checked(p));
+// Bounds on what the stages after the pieces can add, so that an evaluation
+// with a window can stop once they can't bring the score back inside it.
+// The per passer and per piece parts come from the parameters at startup.
+Score passer_low_bound[7], passer_high_bound[7];
+Score threat_high_bound[6]; // Every threat on a piece of each type
+Score king_threat_high_bound;
+
+inline Score min_score(Score a, Score b) { return Score{std::min(mg_value(a), mg_value(b)), std::min(eg_value(a), eg_value(b))}; }
+inline Score max_score(Score a, Score b) { return Score{std::max(mg_value(a), mg_value(b)), std::max(eg_value(a), eg_value(b))}; }
+
+void init_lazy_eval() {
+    for (int r = 0; r < 7; ++r) {
+        passer_low_bound[r] = passed_pawn_bonus[r] + min_score(passer_blocked[0][r], passer_blocked[1][r]) + min_score(passer_unsafe[0][r], passer_unsafe[1][r]);
+        passer_high_bound[r] = passed_pawn_bonus[r] + max_score(passer_blocked[0][r], passer_blocked[1][r]) + max_score(passer_unsafe[0][r], passer_unsafe[1][r]);
+
+        // Kings are at most 7 squares away
+        passer_low_bound[r] += Score{0, std::min(0, -7 * passer_my_distance[r]) + std::min(0, 7 * passer_enemy_distance[r])};
+        passer_high_bound[r] += Score{0, std::max(0, -7 * passer_my_distance[r]) + std::max(0, 7 * passer_enemy_distance[r])};
+    }
+
+    // Threat bonuses are never negative
+    for (int t = PAWN; t <= QUEEN; ++t) {
+        threat_high_bound[t] = minor_threat_bonus[t] + rook_threat_bonus[t] + pawn_threat_bonus[t];
+    }
+    king_threat_high_bound = max_score(king_threat_bonus[0], king_threat_bonus[1]);
+}
+
+void king_bounds(Evaluation *eval, Position *p, Color color, Score *low, Score *high) {
+    // evaluate_king never goes above the pawn shelter. At worst the king has
+    // all 16 flank squares attacked twice, its closest pawn 8 squares away and
+    // a safe check from every piece type the opponent attacks with.
+    int pawn_shelter_value = eval->pawntte->pawn_shelter_value[color];
+    *high = Score{pawn_shelter_value, 0};
+    *low = Score{pawn_shelter_value - 32 * king_flank_penalty, -8 * pawn_distance_penalty};
+
+    if (eval->num_king_attackers[color] > (1 - eval->num_queens[~color])) {
+        int king_danger = king_danger_init
+                        - pawn_shelter_value * king_danger_shelter_bonus / 10
+                        - !eval->num_queens[~color] * king_danger_queen_penalty
+                        + eval->num_king_attackers[color] * eval->king_zone_score[color]
+                        + eval->num_king_zone_attacks[color] * king_zone_attack_penalty
+                        + bool(p->info->pinned[color]) * king_danger_pinned_penalty
+                        + count(eval->targets[king(color)] & eval->targets[~color] & ~eval->double_targets[color]) * king_danger_weak_penalty
+                        + count(eval->targets[~color] & ~eval->targets[color] & eval->king_zone[color] & ~p->bbs[~color]) * king_danger_weak_zone_penalty
+                        + bool(eval->targets[queen(~color)]) * queen_check_penalty
+                        + bool(eval->targets[rook(~color)]) * rook_check_penalty
+                        + bool(eval->targets[bishop(~color)]) * bishop_check_penalty
+                        + bool(eval->targets[knight(~color)]) * knight_check_penalty;
+        if (king_danger > 0) {
+            *low -= Score{king_danger * king_danger / 4096, king_danger / 20};
+        }
+    }
+}
+
+Score threat_bound(Evaluation *eval, Position *p, Color color) {
+    // Only attacked pieces can be threatened
+    Bitboard attacked = eval->targets[color] & p->bbs[~color];
+    Score bound = (eval->targets[king(color)] & attacked) ? king_threat_high_bound : Score{0, 0};
+    for (int t = PAWN; t <= QUEEN; ++t) {
+        bound += threat_high_bound[t] * count(attacked & p->bbs[2 * t + ~color]);
+    }
+    return bound;
+}
+
+void passer_bounds(Evaluation *eval, Color color, Score *low, Score *high) {
+    Bitboard passers = eval->pawntte->pawn_passers[color];
+    while (passers) {
+        int r = relative_rank(pop(&passers), color);
+        *low += passer_low_bound[r];
+        *high += passer_high_bound[r];
+    }
+}
+
+inline int blend_score(Position *p, Score score, int phase, int scale) {
+    int ret = (mg_value(score) * phase + eg_value(score) * (256 - phase) * scale / SCALE_NORMAL) / 256;
+    return (p->color == white ? ret : -ret) + tempo;
+}
+
+bool lazy_cutoff(Position *p, Score low, Score high, int phase, int scale, int alpha, int beta, int *score, bool *exact) {
+    // Blending is monotonic, so the bounds of the white score bound the final one
+    int a = blend_score(p, low, phase, scale);
+    int b = blend_score(p, high, phase, scale);
+    *exact = a == b;
+    if (std::min(a, b) >= beta || *exact) {
+        *score = std::min(a, b);
+        return true;
+    }
+    if (std::max(a, b) <= alpha) {
+        *score = std::max(a, b);
+        return true;
+    }
+    return false;
+}
+
+int evaluate_position(Position *p, int alpha, int beta, bool *exact) {
+    *exact = true;
     Evaluation eval;
     pre_eval(&eval, p);
 
@@ -460,19 +545,116 @@ int evaluate(Position *p) {
     evaluate_pawns(&eval, p);
     eval.score += eval.pawntte->score[white] - eval.pawntte->score[black];
 
-    int early = (eval.score.midgame + eval.score.endgame) / 2;
+    int early = (mg_value(eval.score) + eg_value(eval.score)) / 2;
     if (std::abs(early) > 1000) {
         return p->color == white ? early : -early;
     }
 
     Material *eval_material = get_material(p);
-    eval.score += eval_material->score;
+    eval.score += Score{eval_material->score, eval_material->score};
     eval.score += evaluate_pieces(&eval, p, white) - evaluate_pieces(&eval, p, black);
-    eval.score += evaluate_king(&eval, p, white) - evaluate_king(&eval, p, black) +
-                  evaluate_threat(&eval, p, white) - evaluate_threat(&eval, p, black) +
-                  evaluate_passers(&eval, p, white) - evaluate_passers(&eval, p, black);
+    eval.score += evaluate_pawn_push_threats(&eval, p);
 
+    int phase = eval_material->phase;
     int scale = scaling_factor(p);
-    int ret = (eval.score.midgame * eval_material->phase + eval.score.endgame * (256 - eval_material->phase) * scale / SCALE_NORMAL) / 256;
-    return (p->color == white ? ret : -ret) + tempo;
+    TTStats *stats = &p->my_thread->tt_stats;
+    int score = blend_score(p, eval.score, phase, scale);
+
+    // Bounding the stages only pays off when the score so far is outside the window
+    bool lazy = score >= beta || score <= alpha;
+
+    // Ranges of white minus black for each stage still to come
+    Score king_low, king_high, threat_low, threat_high, passer_low, passer_high;
+    if (lazy) {
+        ++stats->lazy_evals;
+        Score white_low, white_high, black_low, black_high;
+        king_bounds(&eval, p, white, &white_low, &white_high);
+        king_bounds(&eval, p, black, &black_low, &black_high);
+        king_low = white_low - black_high;
+        king_high = white_high - black_low;
+
+        threat_low = Score{0, 0} - threat_bound(&eval, p, black);
+        threat_high = threat_bound(&eval, p, white);
+
+        white_low = white_high = black_low = black_high = Score{0, 0};
+        passer_bounds(&eval, white, &white_low, &white_high);
+        passer_bounds(&eval, black, &black_low, &black_high);
+        passer_low = white_low - black_high;
+        passer_high = white_high - black_low;
+
+        if (lazy_cutoff(p, eval.score + king_low + threat_low + passer_low, eval.score + king_high + threat_high + passer_high,
+                        phase, scale, alpha, beta, &score, exact)) {
+            ++stats->lazy_cuts[0];
+            return score;
+        }
+    }
+
+    eval.score += evaluate_king(&eval, p, white) - evaluate_king(&eval, p, black);
+    if (lazy && lazy_cutoff(p, eval.score + threat_low + passer_low, eval.score + threat_high + passer_high, phase, scale, alpha, beta, &score, exact)) {
+        ++stats->lazy_cuts[1];
+        return score;
+    }
+
+    eval.score += evaluate_threat(&eval, p, white) - evaluate_threat(&eval, p, black);
+    if (lazy && lazy_cutoff(p, eval.score + passer_low, eval.score + passer_high, phase, scale, alpha, beta, &score, exact)) {
+        ++stats->lazy_cuts[2];
+        return score;
+    }
+
+    eval.score += evaluate_passers(&eval, p, white) - evaluate_passers(&eval, p, black);
+    *exact = true;
+    return blend_score(p, eval.score, phase, scale);
+}
+
+int evaluate(Position *p) {
+    bool exact;
+    return evaluate(p, -INFINITE, INFINITE, &exact);
+}
+
+int evaluate(Position *p, int alpha, int beta, bool *exact) {
+    assert(!is_checked(p));
+    *exact = true;
+#ifndef __TUNE__
+    SearchThread *my_thread = p->my_thread;
+    uint64_t hash = p->info->hash;
+    uint64_t *entry = &my_thread->evalcache[hash & (evalcache_size - 1)];
+
+    ++my_thread->tt_stats.eval_probes;
+    if (*entry && ((*entry ^ hash) >> 16) == 0) {
+        ++my_thread->tt_stats.eval_hits;
+        return int16_t(*entry & 0xFFFF);
+    }
+
+#ifdef __NNUE__
+    int score = use_nnue ? nnue_evaluate(p) : evaluate_position(p, alpha, beta, exact);
+#else
+    int score = evaluate_position(p, alpha, beta, exact);
+#endif
+    // Bounds from a lazy evaluation only hold for this window
+    if (*exact) {
+        *entry = (hash & ~0xFFFFULL) | uint16_t(score);
+    }
+    return score;
+#else
+    // Parameters change between evaluations while tuning
+    (void) alpha;
+    (void) beta;
+    return evaluate_position(p, -INFINITE, INFINITE, exact);
+#endif
+}
+
+void print_eval_stats() {
+    const char *stage_names[lazy_eval_stages] = {"king safety", "threats", "passers"};
+
+    TTStats total;
+    sum_tt_stats(&total);
+
+    // A cut before a stage skips every stage after it too
+    uint64_t skipped = 0;
+    std::cout << "Lazy evals   : " << total.lazy_evals << std::endl;
+    for (int s = 0; s < lazy_eval_stages; ++s) {
+        skipped += total.lazy_cuts[s];
+        std::cout << "  skipped " << std::setw(11) << std::left << stage_names[s] << std::right << " : "
+                  << skipped << " (" << skipped * 100 / (total.lazy_evals + 1) << "%)" << std::endl;
+    }
 }
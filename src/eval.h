@@ -41,6 +41,9 @@ const Bitboard flank_files[8] = {
     kingside_flank
 };
 
+void init_lazy_eval();
 int evaluate(Position *p);
+int evaluate(Position *p, int alpha, int beta, bool *exact);
+void print_eval_stats();
 
 #endif
@@ -26,7 +26,7 @@ typedef struct Magic{
     Bitboard magic;
 } Magic;
 
-const Magic rookMagic[64] = {
+constexpr Magic rookMagic[64] = {
     { 0x000101010101017EULL, 0xE580008110204000ULL }, { 0x000202020202027CULL, 0x0160002008011000ULL },
     { 0x000404040404047AULL, 0x3520080020000400ULL }, { 0x0008080808080876ULL, 0x6408080448002002ULL },
     { 0x001010101010106EULL, 0x1824080004020400ULL }, { 0x002020202020205EULL, 0x9E04088101020400ULL },
@@ -61,7 +61,7 @@ const Magic rookMagic[64] = {
     { 0x3E40404040404000ULL, 0x00010486100110E4ULL }, { 0x7E80808080808000ULL, 0x000100020180406FULL }
 };
 
-const Magic bishopMagic[64] = {
+constexpr Magic bishopMagic[64] = {
     { 0x0040201008040200ULL, 0x00A08800240C0040ULL }, { 0x0000402010080400ULL, 0x0020085008088000ULL },
     { 0x0000004020100A00ULL, 0x0080440306000000ULL }, { 0x0000000040221400ULL, 0x000C520480000000ULL },
     { 0x0000000002442800ULL, 0x0024856000000000ULL }, { 0x0000000204085000ULL, 0x00091430A0000000ULL },
@@ -96,17 +96,10 @@ const Magic bishopMagic[64] = {
     { 0x0020100804020000ULL, 0x0000005002301100ULL }, { 0x0040201008040200ULL, 0x0080881014040040ULL }
 };
 
-void generate_magic_rook_moves();
-void generate_magic_bishop_moves();
+typedef std::array<std::array<Bitboard, 4096>, 64> RookMagicMoves;
+typedef std::array<std::array<Bitboard, 512>, 64> BishopMagicMoves;
 
-Bitboard magicify(int index, Bitboard b);
-
-Bitboard create_rook_attacks(int sq ,Bitboard b);
-Bitboard create_bishop_attacks(int sq ,Bitboard b);
-
-void init_magic();
-
-extern Bitboard rook_magic_moves[64][4096];
-extern Bitboard bishop_magic_moves[64][512];
+extern const RookMagicMoves rook_magic_moves;
+extern const BishopMagicMoves bishop_magic_moves;
 
 #endif
@@ -25,8 +25,8 @@ int main(int argc, char* argv[]) {
     init();
     get_ready();
     if (argc > 1 && strcmp(argv[1], "bench") == 0) {
-        // Calling bench exits the program
-        bench();
+        // Calling bench exits the program, arguments are the same as the bench command
+        bench_args(std::vector<std::string>(argv + 1, argv + argc));
         return 0;
     }
     loop();
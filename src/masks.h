@@ -0,0 +1,378 @@
+/*
+    Defenchess, a chess engine
+    Copyright 2017-2019 Can Cetin, Dogac Eldenk
+
+    Defenchess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Defenchess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MASKS_H
+#define MASKS_H
+
+#include <algorithm>
+#include <array>
+
+#include "const.h"
+
+// Board geometry, generated at compile time. None of it depends on the
+// parameters, so it is shared read-only data that the compiler can fold.
+
+typedef std::array<Bitboard, 64> SquareMasks;
+typedef std::array<std::array<Bitboard, 2>, 64> ColorMasks; // [square][color]
+typedef std::array<std::array<Bitboard, 64>, 64> SquarePairMasks;
+
+constexpr int rank_of(Square s) {return s >> 3;}
+constexpr int file_of(Square s) {return s & 7;}
+
+constexpr Bitboard shift(Bitboard b, int offset) {
+    if (offset > 0) {
+        return b << offset;
+    }
+    return b >> -offset;
+}
+
+constexpr std::array<Bitboard, 65> generate_bfi() {
+    std::array<Bitboard, 65> bfi{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        bfi[sq] = 1ULL << sq;
+    }
+
+    bfi[no_sq] = 0;
+    return bfi;
+}
+
+inline constexpr std::array<Bitboard, 65> bfi = generate_bfi();
+
+constexpr SquareMasks generate_rook_masks(bool horizontal) {
+    SquareMasks masks{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        masks[sq] = horizontal ? RANK_MASK[rank_of(sq)] : FILE_MASK[file_of(sq)];
+    }
+    return masks;
+}
+
+inline constexpr SquareMasks ROOK_MASKS_HORIZONTAL = generate_rook_masks(true);
+inline constexpr SquareMasks ROOK_MASKS_VERTICAL = generate_rook_masks(false);
+
+constexpr SquareMasks generate_bishop_masks(const uint64_t *crosses) {
+    SquareMasks masks{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        for (int j = 0; j < 15; ++j) {
+            if (bfi[sq] & crosses[j]) {
+                masks[sq] = crosses[j];
+            }
+        }
+    }
+    return masks;
+}
+
+inline constexpr SquareMasks BISHOP_MASKS_1 = generate_bishop_masks(cross_lt);
+inline constexpr SquareMasks BISHOP_MASKS_2 = generate_bishop_masks(cross_rt);
+
+constexpr SquareMasks combine_masks(const SquareMasks &a, const SquareMasks &b) {
+    SquareMasks masks{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        masks[sq] = a[sq] | b[sq];
+    }
+    return masks;
+}
+
+inline constexpr SquareMasks ROOK_MASKS_COMBINED = combine_masks(ROOK_MASKS_VERTICAL, ROOK_MASKS_HORIZONTAL);
+inline constexpr SquareMasks BISHOP_MASKS_COMBINED = combine_masks(BISHOP_MASKS_1, BISHOP_MASKS_2);
+
+constexpr Bitboard knight_king_possibles(Square sq) {
+    switch(file_of(sq)){
+        case FILE_A:
+            return FILE_ABB | FILE_BBB | FILE_CBB;
+        case FILE_B:
+            return FILE_ABB | FILE_BBB | FILE_CBB | FILE_DBB;
+        case FILE_G:
+            return FILE_EBB | FILE_FBB | FILE_GBB | FILE_HBB;
+        case FILE_H:
+            return FILE_FBB | FILE_GBB | FILE_HBB;
+        default:
+            return ~0ULL;
+    }
+}
+
+constexpr SquareMasks generate_step_masks(Bitboard targets) {
+    // The targets are drawn around C3
+    SquareMasks masks{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        masks[sq] = shift(targets, sq - 21) & knight_king_possibles(sq);
+    }
+    return masks;
+}
+
+inline constexpr SquareMasks KNIGHT_MASKS = generate_step_masks(_knight_targets);
+inline constexpr SquareMasks KING_MASKS = generate_step_masks(_king_targets);
+
+constexpr std::array<SquareMasks, 2> generate_king_extended() {
+    std::array<SquareMasks, 2> masks{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        masks[white][sq] = (KING_MASKS[sq] | (KING_MASKS[sq] << 8)) & ~bfi[sq];
+        masks[black][sq] = (KING_MASKS[sq] | (KING_MASKS[sq] >> 8)) & ~bfi[sq];
+    }
+    return masks;
+}
+
+inline constexpr std::array<SquareMasks, 2> KING_EXTENDED_MASKS = generate_king_extended();
+
+inline constexpr std::array<Bitboard, 2> bfi_queen_castle = {bfi[C1], bfi[C8]};
+inline constexpr std::array<Bitboard, 2> bfi_king_castle = {bfi[G1], bfi[G8]};
+
+constexpr std::array<int, 64> generate_castle_type() {
+    std::array<int, 64> castle_type{};
+    castle_type[G1] = KINGSIDE;
+    castle_type[C1] = QUEENSIDE;
+    castle_type[G8] = KINGSIDE;
+    castle_type[C8] = QUEENSIDE;
+    return castle_type;
+}
+
+constexpr std::array<Square, 64> generate_rook_moves_castle_to() {
+    std::array<Square, 64> rook_to{};
+    rook_to[G1] = F1;
+    rook_to[C1] = D1;
+    rook_to[G8] = F8;
+    rook_to[C8] = D8;
+    return rook_to;
+}
+
+inline constexpr std::array<int, 64> CASTLE_TYPE = generate_castle_type();
+inline constexpr std::array<Square, 64> ROOK_MOVES_CASTLE_TO = generate_rook_moves_castle_to();
+
+constexpr std::array<Square, 64> generate_enpassants() {
+    std::array<Square, 64> enpassant_index{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        if (sq >= A2 && sq <= H3) {
+            enpassant_index[sq] = sq + 8;
+        }
+        if (sq >= A6 && sq <= H7) {
+            enpassant_index[sq] = sq - 8;
+        }
+    }
+    return enpassant_index;
+}
+
+inline constexpr std::array<Square, 64> ENPASSANT_INDEX = generate_enpassants();
+
+constexpr bool on_diagonal(Square i, Square j) {
+    return rank_of(i) - rank_of(j) == file_of(i) - file_of(j) || rank_of(i) - rank_of(j) == file_of(j) - file_of(i);
+}
+
+constexpr SquarePairMasks generate_fromto() {
+    SquarePairMasks fromto{};
+    for (Square i = A1; i <= H8; ++i) {
+        for (Square j = A1; j <= H8; ++j) {
+            if (i == j) {
+                continue;
+            }
+            if (file_of(i) == file_of(j)) {
+                fromto[i][j] = FILE_MASK[file_of(i)];
+            } else if (rank_of(i) == rank_of(j)) {
+                fromto[i][j] = RANK_MASK[rank_of(i)];
+            } else if (on_diagonal(i, j)) {
+                if (i > j) {
+                    fromto[i][j] = file_of(i) < file_of(j) ? BISHOP_MASKS_1[i] : BISHOP_MASKS_2[i];
+                } else {
+                    fromto[i][j] = file_of(i) > file_of(j) ? BISHOP_MASKS_1[i] : BISHOP_MASKS_2[i];
+                }
+            }
+        }
+    }
+    return fromto;
+}
+
+inline constexpr SquarePairMasks FROMTO_MASK = generate_fromto();
+
+constexpr SquarePairMasks generate_between() {
+    SquarePairMasks between{};
+    for (Square i = A1; i <= H8; ++i) {
+        for (Square j = A1; j <= H8; ++j) {
+            if (i == j) {
+                continue;
+            }
+            if (file_of(i) == file_of(j)) {
+                if (i > j) {
+                    between[i][j] = (bfi[i] - 2 * bfi[j]) & FILE_MASK[file_of(i)];
+                } else {
+                    between[i][j] = (bfi[j] - 2 * bfi[i]) & FILE_MASK[file_of(i)];
+                }
+            } else if (rank_of(i) == rank_of(j)) {
+                if (i > j) {
+                    between[i][j] = bfi[i] - 2 * bfi[j];
+                } else {
+                    between[i][j] = bfi[j] - 2 * bfi[i];
+                }
+            } else if (on_diagonal(i, j)) {
+                if (i > j) {
+                    between[i][j] = (bfi[i] - 2 * bfi[j]) & (file_of(i) < file_of(j) ? BISHOP_MASKS_1[i] : BISHOP_MASKS_2[i]);
+                } else {
+                    between[i][j] = (bfi[j] - 2 * bfi[i]) & (file_of(i) > file_of(j) ? BISHOP_MASKS_1[i] : BISHOP_MASKS_2[i]);
+                }
+            }
+        }
+    }
+    return between;
+}
+
+inline constexpr SquarePairMasks BETWEEN_MASK = generate_between();
+
+constexpr SquarePairMasks generate_between_inclusive() {
+    SquarePairMasks between{};
+    for (Square i = A1; i <= H8; ++i) {
+        for (Square j = A1; j <= H8; ++j) {
+            between[i][j] = BETWEEN_MASK[i][j] | bfi[i] | bfi[j];
+        }
+    }
+    return between;
+}
+
+inline constexpr SquarePairMasks BETWEEN_MASK_INCLUSIVE = generate_between_inclusive();
+
+constexpr std::array<ColorMasks, 3> generate_pawn_masks() {
+    // Single pushes, double pushes and captures
+    std::array<ColorMasks, 3> masks{};
+    for (Square sq = A2; sq <= H7; ++sq) {
+        masks[0][sq][white] = bfi[sq + 8];
+        masks[0][sq][black] = bfi[sq - 8];
+        if (rank_of(sq) == RANK_2) {
+            masks[1][sq][white] |= bfi[sq + 16];
+        }
+        if (rank_of(sq) == RANK_7) {
+            masks[1][sq][black] |= bfi[sq - 16];
+        }
+    }
+    for (Square sq = A1; sq <= H8; ++sq) {
+        int file = file_of(sq);
+        if (file != FILE_A) {
+            if (sq + 7 <= H8) {
+                masks[2][sq][white] |= bfi[sq + 7];
+            }
+            if (sq - 9 >= A1) {
+                masks[2][sq][black] |= bfi[sq - 9];
+            }
+        }
+        if (file != FILE_H) {
+            if (sq + 9 <= H8) {
+                masks[2][sq][white] |= bfi[sq + 9];
+            }
+            if (sq - 7 >= A1) {
+                masks[2][sq][black] |= bfi[sq - 7];
+            }
+        }
+    }
+    return masks;
+}
+
+inline constexpr std::array<ColorMasks, 3> PAWN_MASKS = generate_pawn_masks();
+inline constexpr ColorMasks PAWN_ADVANCE_MASK_1 = PAWN_MASKS[0];
+inline constexpr ColorMasks PAWN_ADVANCE_MASK_2 = PAWN_MASKS[1];
+inline constexpr ColorMasks PAWN_CAPTURE_MASK = PAWN_MASKS[2];
+
+constexpr ColorMasks generate_passed_pawns() {
+    ColorMasks passed_pawn_horizontal{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        for (Square j = sq + 8; j <= H8; j += 8) {
+            passed_pawn_horizontal[sq][white] |= ROOK_MASKS_HORIZONTAL[j];
+        }
+        for (Square j = sq - 8; j >= A1; j -= 8) {
+            passed_pawn_horizontal[sq][black] |= ROOK_MASKS_HORIZONTAL[j];
+        }
+    }
+
+    ColorMasks passed_pawn{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        Bitboard files = ROOK_MASKS_VERTICAL[sq];
+        if (file_of(sq) != FILE_A) {
+            files |= ROOK_MASKS_VERTICAL[sq - 1];
+        }
+        if (file_of(sq) != FILE_H) {
+            files |= ROOK_MASKS_VERTICAL[sq + 1];
+        }
+        passed_pawn[sq][white] = files & passed_pawn_horizontal[sq][white];
+        passed_pawn[sq][black] = files & passed_pawn_horizontal[sq][black];
+    }
+    return passed_pawn;
+}
+
+inline constexpr ColorMasks PASSED_PAWN_MASK = generate_passed_pawns();
+
+constexpr ColorMasks generate_front_masks() {
+    ColorMasks front{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        for (Square j = sq + 8; j <= H8; j += 8) {
+            front[sq][white] |= bfi[j];
+        }
+        for (Square j = sq - 8; j >= A1; j -= 8) {
+            front[sq][black] |= bfi[j];
+        }
+    }
+    return front;
+}
+
+inline constexpr ColorMasks FRONT_MASK = generate_front_masks();
+
+constexpr ColorMasks generate_front_rank_masks() {
+    ColorMasks front_rank{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        int my_rank = rank_of(sq);
+
+        for (int r = my_rank + 1; r <= RANK_8; ++r) {
+            front_rank[sq][white] |= RANK_MASK[r];
+        }
+
+        for (int r = my_rank - 1; r >= RANK_1; --r) {
+            front_rank[sq][black] |= RANK_MASK[r];
+        }
+    }
+    return front_rank;
+}
+
+inline constexpr ColorMasks FRONT_RANK_MASKS = generate_front_rank_masks();
+
+constexpr SquareMasks generate_adjacent() {
+    SquareMasks adjacent{};
+    for (Square sq = A1; sq <= H8; ++sq) {
+        if (file_of(sq) == FILE_A) {
+            adjacent[sq] = bfi[sq+1];
+        } else if (file_of(sq) == FILE_H) {
+            adjacent[sq] = bfi[sq-1];
+        } else {
+            adjacent[sq] = bfi[sq-1] | bfi[sq+1];
+        }
+    }
+    return adjacent;
+}
+
+inline constexpr SquareMasks ADJACENT_MASK = generate_adjacent();
+
+constexpr std::array<std::array<Bitboard, 8>, 64> generate_distance_rings() {
+    std::array<std::array<Bitboard, 8>, 64> rings{};
+    for (Square s1 = A1; s1 <= H8; ++s1) {
+        for (Square s2 = A1; s2 <= H8; ++s2) {
+            if (s1 != s2) {
+                int col_distance = file_of(s1) - file_of(s2);
+                int row_distance = rank_of(s1) - rank_of(s2);
+                int distance = std::max(std::max(col_distance, -col_distance), std::max(row_distance, -row_distance));
+                rings[s1][distance - 1] |= bfi[s2];
+            }
+        }
+    }
+    return rings;
+}
+
+inline constexpr std::array<std::array<Bitboard, 8>, 64> DISTANCE_RING = generate_distance_rings();
+
+#endif
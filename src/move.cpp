@@ -19,6 +19,8 @@
 #include "move.h"
 #include "target.h"
 #include "movegen.h"
+#include "nnue.h"
+#include "tt.h"
 
 void insert_piece_no_hash(Position *p, Square sq, Piece piece) {
     Color color = piece_color(piece);
@@ -219,10 +221,16 @@ void make_move(Position *p, Move move) {
         new_info->hash ^= castling_hash[castling_rights];
     }
 
+    // The hash is final, start loading the bucket of the child position
+    prefetch_tt(new_info->hash);
+
     p->color = opponent;
     new_info->captured = captured;
     new_info->pinned[white] = pinned_piece_squares(p, white);
     new_info->pinned[black] = pinned_piece_squares(p, black);
+#ifdef __NNUE__
+    nnue_make_move(p, info, move, piece, captured);
+#endif
 
     assert(is_position_valid(p));
 }
@@ -246,9 +254,14 @@ void make_null_move(Position *p) {
         new_info->hash ^= enpassant_hash[file_of(info->enpassant)];
     }
 
+    prefetch_tt(new_info->hash);
+
     p->color = ~p->color;
     new_info->pinned[white] = pinned_piece_squares(p, white);
     new_info->pinned[black] = pinned_piece_squares(p, black);
+#ifdef __NNUE__
+    nnue_copy(new_info, info);
+#endif
 
     assert(is_position_valid(p));
 }
@@ -307,11 +320,12 @@ bool is_pseudolegal(Position *p, Move move) {
     int m_type = move_type(move);
 
     if (m_type != NORMAL) {
-        MoveGen movegen = blank_movegen;
+        MoveGen movegen;
         movegen.position = p;
+        movegen.head = movegen.tail = 0;
         generate_moves<ALL>(&movegen, p);
         for (uint8_t i = movegen.head; i < movegen.tail; ++i) {
-            Move gen_move = movegen.moves[i].move;
+            Move gen_move = movegen.moves[i];
             if (move == gen_move) {
                 return true;
             }
@@ -24,12 +24,10 @@
 #include "see.h"
 #include "target.h"
 
-bool scored_move_compare(ScoredMove lhs, ScoredMove rhs) { return lhs.score < rhs.score; }
-
 void print_movegen(MoveGen *movegen) {
     std::cout << "movegen: ";
     for (int i = movegen->head; i < movegen->tail; i++) {
-        std::cout << move_to_str(movegen->position, movegen->moves[i].move) << "(" << movegen->moves[i].score << "), ";
+        std::cout << move_to_str(movegen->position, movegen->moves[i]) << "(" << movegen->scores[i] << "), ";
     }
     std::cout << std::endl;
 }
@@ -37,36 +35,48 @@ void print_movegen(MoveGen *movegen) {
 void score_moves(MoveGen *movegen, Metadata *md, ScoreType score_type) {
     if (score_type == SCORE_CAPTURE) {
         for (uint8_t i = movegen->head; i < movegen->tail; ++i) {
-            movegen->moves[i].score = score_capture_mvvlva(movegen->position, movegen->moves[i].move);
+            movegen->scores[i] = score_capture_mvvlva(movegen->position, movegen->moves[i]);
         }
     } else if (score_type == SCORE_QUIET) {
         for (uint8_t i = movegen->head; i < movegen->tail; ++i) {
-            movegen->moves[i].score = score_quiet(movegen->position, md, movegen->moves[i].move);
+            movegen->scores[i] = score_quiet(movegen->position, md, movegen->moves[i]);
         }
     } else { // Evasions
         for (uint8_t i = movegen->head; i < movegen->tail; ++i) {
-            if (is_capture(movegen->position, movegen->moves[i].move)) {
-                movegen->moves[i].score = score_capture_mvvlva(movegen->position, movegen->moves[i].move);
+            if (is_capture(movegen->position, movegen->moves[i])) {
+                movegen->scores[i] = score_capture_mvvlva(movegen->position, movegen->moves[i]);
             } else {
-                movegen->moves[i].score = score_quiet(movegen->position, md, movegen->moves[i].move) - (1 << 20);
+                movegen->scores[i] = score_quiet(movegen->position, md, movegen->moves[i]) - (1 << 20);
             }
         }
     }
 }
 
-ScoredMove pick_best(ScoredMove *moves, uint8_t head, uint8_t tail) {
-    std::swap(moves[head], *std::max_element(moves + head, moves + tail, scored_move_compare));
-    return moves[head];
+Move pick_best(MoveGen *movegen) {
+    // Swaps the best scored move to head and consumes it
+    uint8_t head = movegen->head++;
+    uint8_t best = head;
+    for (uint8_t i = head + 1; i < movegen->tail; ++i) {
+        if (movegen->scores[i] > movegen->scores[best]) {
+            best = i;
+        }
+    }
+    std::swap(movegen->moves[head], movegen->moves[best]);
+    std::swap(movegen->scores[head], movegen->scores[best]);
+    return movegen->moves[head];
 }
 
-void insertion_sort(ScoredMove *moves, uint8_t head, uint8_t tail) {
+void insertion_sort(MoveGen *movegen) {
     uint8_t i, j;
-    for (i = head + 1; i < tail; ++i) {
-        ScoredMove tmp = moves[i];
-        for (j = i; j != head && moves[j - 1].score < tmp.score; --j) {
-            moves[j] = moves[j - 1];
+    for (i = movegen->head + 1; i < movegen->tail; ++i) {
+        Move move = movegen->moves[i];
+        int score = movegen->scores[i];
+        for (j = i; j != movegen->head && movegen->scores[j - 1] < score; --j) {
+            movegen->moves[j] = movegen->moves[j - 1];
+            movegen->scores[j] = movegen->scores[j - 1];
         }
-        moves[j] = tmp;
+        movegen->moves[j] = move;
+        movegen->scores[j] = score;
     }
 }
 
@@ -85,7 +95,7 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
 
         case GOOD_CAPTURES:
             while (movegen->head < movegen->tail) {
-                move = pick_best(movegen->moves, movegen->head++, movegen->tail).move;
+                move = pick_best(movegen);
 
                 if (move == movegen->tte_move) {
                     continue;
@@ -95,7 +105,7 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
                     return move;
                 }
 
-                movegen->moves[movegen->end_bad_captures++] = ScoredMove{move, 0};
+                movegen->moves[movegen->end_bad_captures++] = move;
             }
 
             ++movegen->stage;
@@ -136,13 +146,13 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
             movegen->head = movegen->tail = movegen->end_bad_captures;
             generate_moves<SILENT>(movegen, movegen->position);
             score_moves(movegen, md, SCORE_QUIET);
-            insertion_sort(movegen->moves, movegen->head, movegen->tail);
+            insertion_sort(movegen);
             ++movegen->stage;
             /* fallthrough */
 
         case QUIETS:
             while (movegen->head < movegen->tail) {
-                move = movegen->moves[movegen->head++].move;
+                move = movegen->moves[movegen->head++];
                 if (move != movegen->tte_move &&
                     move != md->killers[0] &&
                     move != md->killers[1] &&
@@ -156,7 +166,7 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
 
         case BAD_CAPTURES:
             if (movegen->head < movegen->end_bad_captures) {
-                move = movegen->moves[movegen->head++].move;
+                move = movegen->moves[movegen->head++];
                 if (move != movegen->tte_move) {
                     return move;
                 }
@@ -171,7 +181,7 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
 
         case EVASIONS:
             while (movegen->head < movegen->tail) {
-                return pick_best(movegen->moves, movegen->head++, movegen->tail).move;
+                return pick_best(movegen);
             }
             break;
 
@@ -187,7 +197,7 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
 
         case QUIESCENCE_CAPTURES:
             while (movegen->head < movegen->tail) {
-                move = pick_best(movegen->moves, movegen->head++, movegen->tail).move;
+                move = pick_best(movegen);
                 if (move != movegen->tte_move) {
                     return move;
                 }
@@ -203,7 +213,7 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
 
         case QUIESCENCE_CHECKS:
             while (movegen->head < movegen->tail) {
-                move = movegen->moves[movegen->head++].move;
+                move = movegen->moves[movegen->head++];
                 if (move != movegen->tte_move) {
                     return move;
                 }
@@ -222,7 +232,7 @@ Move next_move(MoveGen *movegen, Metadata *md, int depth) {
 
         case PROBCUT_CAPTURES:
             while (movegen->head < movegen->tail) {
-                move = pick_best(movegen->moves, movegen->head++, movegen->tail).move;
+                move = pick_best(movegen);
                 if (move != movegen->tte_move && see_capture(movegen->position, move, movegen->threshold)) {
                     return move;
                 }
@@ -243,11 +253,17 @@ MoveGen new_movegen(Position *p, Metadata *md, Move tte_move, uint8_t type, int
         tm = no_move;
         movegen_stage = EVASIONS_SORT;
     } else {
+        if (tte_move != no_move && !is_pseudolegal(p, tte_move)) {
+            // The entry was written for a different position with the same key
+            ++p->my_thread->tt_stats.collisions;
+            tte_move = no_move;
+        }
+
         if (type == NORMAL_SEARCH) {
-            tm = tte_move != no_move && is_pseudolegal(p, tte_move) ? tte_move : no_move;
+            tm = tte_move;
             movegen_stage = NORMAL_TTE_MOVE;
         } else {
-            tm = tte_move != no_move && is_pseudolegal(p, tte_move) && is_capture(p, tte_move) ? tte_move : no_move;
+            tm = tte_move != no_move && is_capture(p, tte_move) ? tte_move : no_move;
             movegen_stage = type == QUIESCENCE_SEARCH ? QUIESCENCE_TTE_MOVE : PROBCUT_TTE_MOVE;
         }
 
@@ -257,17 +273,16 @@ MoveGen new_movegen(Position *p, Metadata *md, Move tte_move, uint8_t type, int
     }
 
     Square prev_to = move_to((md-1)->current_move);
-    MoveGen movegen = {
-        {}, // Moves
-        p, // Position
-        tm, // tte_move
-        p->my_thread->counter_moves[p->pieces[prev_to]][prev_to], // counter move
-        movegen_stage, // stage
-        0, // head
-        0, // tail
-        0, // end bad captures
-        threshold // threshold
-    };
+    // Filled field by field so that the move and score arrays stay untouched
+    MoveGen movegen;
+    movegen.position = p;
+    movegen.tte_move = tm;
+    movegen.counter_move = p->my_thread->counter_moves[p->pieces[prev_to]][prev_to];
+    movegen.stage = movegen_stage;
+    movegen.head = 0;
+    movegen.tail = 0;
+    movegen.end_bad_captures = 0;
+    movegen.threshold = threshold;
     assert(!(md->ply == 0 && (md-1)->current_move != no_move));
     return movegen;
 }
@@ -441,3 +456,91 @@ void generate_quiet_checks(MoveGen *movegen, Position *p) {
         }
     }
 }
+
+int count_pawn_moves(Position *p, Bitboard pawns, Bitboard target) {
+    Color color = p->color;
+    Bitboard relative_rank3 = color == white ? RANK_3BB : RANK_6BB;
+    Bitboard promotion_rank = color == white ? RANK_8BB : RANK_1BB;
+    int up = color == white ? 8 : -8;
+
+    Bitboard empty_squares = ~p->board;
+    Bitboard one_move = shift(pawns, up) & empty_squares;
+    Bitboard two_move = shift(one_move & relative_rank3, up) & empty_squares & target;
+    Bitboard left_captures = shift(pawns & ~FILE_ABB, up - 1) & p->bbs[~color] & target;
+    Bitboard right_captures = shift(pawns & ~FILE_HBB, up + 1) & p->bbs[~color] & target;
+    one_move &= target;
+
+    // Each promotion counts four times, one for every piece
+    return count(one_move) + count(two_move) + count(left_captures) + count(right_captures) +
+           3 * (count(one_move & promotion_rank) + count(left_captures & promotion_rank) + count(right_captures & promotion_rank));
+}
+
+int count_legal_moves(Position *p) {
+    // Counts without generating: pinned pieces stay on their pin line and
+    // when in check, the other pieces have to block or capture the checker
+    Color color = p->color;
+    Square king_sq = p->king_index[color];
+    Bitboard own = p->bbs[color];
+    Bitboard pinned = p->info->pinned[color] & own;
+    Bitboard checkers = targeted_from(p, p->board, color, king_sq);
+    int moves = 0;
+
+    // King moves are checked against the board without the king, so it can't hide behind itself
+    Bitboard king_board = p->board ^ bfi[king_sq];
+    Bitboard b = generate_king_targets(king_sq) & ~own;
+    while (b) {
+        Square to = pop(&b);
+        if (!targeted_from_with_king(p, king_board, color, to)) {
+            ++moves;
+        }
+    }
+
+    if (more_than_one(checkers)) {
+        return moves;
+    }
+
+    Bitboard target = ~own;
+    if (checkers) {
+        // Block or capture the checker, pin_mask keeps pinned pieces out of it
+        Square checker = lsb(checkers);
+        target &= BETWEEN_MASK[king_sq][checker] | checkers;
+    } else {
+        moves += can_king_castle(p) + can_queen_castle(p);
+    }
+
+    Bitboard bbs = p->bbs[knight(color)] & ~pinned;
+    while (bbs) {
+        moves += count(generate_knight_targets(pop(&bbs)) & target);
+    }
+
+    bbs = (p->bbs[bishop(color)] | p->bbs[queen(color)]);
+    while (bbs) {
+        Square sq = pop(&bbs);
+        moves += count(generate_bishop_targets(p->board, sq) & target & pin_mask(p, color, sq));
+    }
+
+    bbs = (p->bbs[rook(color)] | p->bbs[queen(color)]);
+    while (bbs) {
+        Square sq = pop(&bbs);
+        moves += count(generate_rook_targets(p->board, sq) & target & pin_mask(p, color, sq));
+    }
+
+    moves += count_pawn_moves(p, p->bbs[pawn(color)] & ~pinned, target);
+
+    bbs = p->bbs[pawn(color)] & pinned;
+    while (bbs) {
+        Square sq = pop(&bbs);
+        moves += count_pawn_moves(p, bfi[sq], target & pin_mask(p, color, sq));
+    }
+
+    // En passant can uncover an attack along the rank, these are rare enough to test one by one
+    Square ep = p->info->enpassant;
+    if (ep != no_sq) {
+        bbs = PAWN_CAPTURE_MASK[ep][~color] & p->bbs[pawn(color)];
+        while (bbs) {
+            moves += is_legal(p, _movecast(pop(&bbs), ep, ENPASSANT));
+        }
+    }
+
+    return moves;
+}
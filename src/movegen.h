@@ -36,9 +36,9 @@ inline void get_history_scores(Position *p, Metadata *md, Move move, int *histor
     Square to = move_to(move);
     Piece piece = p->pieces[from];
 
-    *history = p->my_thread->history[p->color][from][to];
-    *cmh = (md-1)->counter_move_history[piece][to];
-    *fmh = (md-2)->counter_move_history[piece][to];
+    *history = __atomic_load_n(&p->my_thread->history[p->color][from][to], __ATOMIC_RELAXED);
+    *cmh = (md-1)->counter_move_history[cmh_index(piece, to)];
+    *fmh = (md-2)->counter_move_history[cmh_index(piece, to)];
 }
 
 inline int score_quiet(Position *p, Metadata *md, Move move) {
@@ -46,14 +46,14 @@ inline int score_quiet(Position *p, Metadata *md, Move move) {
     Square to = move_to(move);
     Piece piece = p->pieces[from];
 
-    return p->my_thread->history[p->color][from][to] +
-           (md-1)->counter_move_history[piece][to] +
-           (md-2)->counter_move_history[piece][to];
+    return __atomic_load_n(&p->my_thread->history[p->color][from][to], __ATOMIC_RELAXED) +
+           (md-1)->counter_move_history[cmh_index(piece, to)] +
+           (md-2)->counter_move_history[cmh_index(piece, to)];
 }
 
 inline int score_capture_mvvlva(Position *p, Move move) {
     Piece from_piece = p->pieces[move_from(move)];
-    Piece to_piece = p->pieces[move_to(move)];
+    Piece to_piece = move_type(move) == ENPASSANT ? pawn(~p->color) : p->pieces[move_to(move)];
 
     // For a pawn capturing a queen, we get 1200 - 2
     // For a queen capturing a pawn, we get 100 - 10 or something
@@ -65,18 +65,20 @@ inline bool no_moves(MoveGen *movegen) {
 }
 
 inline void append_move(Move m, MoveGen *movegen) {
+    assert(movegen->tail < MAX_GEN_MOVES);
 #ifdef __PERFT__
     if (is_legal(movegen->position, m)){
-        movegen->moves[movegen->tail++] = ScoredMove{m, UNDEFINED};
+        movegen->moves[movegen->tail++] = m;
     }
 #else
-    movegen->moves[movegen->tail++] = ScoredMove{m, UNDEFINED};
+    movegen->moves[movegen->tail++] = m;
 #endif
 }
 
 // Should not have to check legality...
 inline void append_evasion(Move m, MoveGen *movegen) {
-    movegen->moves[movegen->tail++] = ScoredMove{m, UNDEFINED};
+    assert(movegen->tail < MAX_GEN_MOVES);
+    movegen->moves[movegen->tail++] = m;
 }
 
 template<MoveGenType Type> inline Bitboard type_mask(Position *p) {
@@ -268,4 +270,5 @@ void generate_moves(MoveGen *movegen, Position *p) {
 }
 
 void generate_quiet_checks(MoveGen *movegen, Position *p);
+int count_legal_moves(Position *p);
 #endif
@@ -0,0 +1,241 @@
+/*
+    Defenchess, a chess engine
+    Copyright 2017-2019 Can Cetin, Dogac Eldenk
+
+    Defenchess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Defenchess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef __NNUE__
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bitboard.h"
+#include "data.h"
+#include "nnue.h"
+
+bool use_nnue = false;
+
+// Network file layout, little endian int16 in this order
+alignas(32) int16_t feature_weights[NNUE_INPUTS * NNUE_HIDDEN];
+alignas(32) int16_t feature_bias[NNUE_HIDDEN];
+alignas(32) int16_t output_weights[2 * NNUE_HIDDEN];
+int16_t output_bias;
+
+const int network_values = NNUE_INPUTS * NNUE_HIDDEN + NNUE_HIDDEN + 2 * NNUE_HIDDEN + 1;
+
+inline const int16_t *feature(Color view, Piece piece, Square sq) {
+    int relative_piece = (piece_color(piece) != view) * 6 + piece_type(piece) - 1;
+    int relative_sq = view == white ? sq : sq ^ 56;
+    return &feature_weights[(relative_piece * 64 + relative_sq) * NNUE_HIDDEN];
+}
+
+// Accumulators are read and written unaligned, the thread infos are heap allocated
+void update_accumulator(int16_t *out, const int16_t *in, const int16_t **added, int added_count, const int16_t **removed, int removed_count) {
+#if defined(__AVX2__)
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + i));
+        for (int j = 0; j < added_count; ++j) {
+            v = _mm256_add_epi16(v, _mm256_load_si256((const __m256i *) (added[j] + i)));
+        }
+        for (int j = 0; j < removed_count; ++j) {
+            v = _mm256_sub_epi16(v, _mm256_load_si256((const __m256i *) (removed[j] + i)));
+        }
+        _mm256_storeu_si256((__m256i *) (out + i), v);
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        for (int j = 0; j < added_count; ++j) {
+            v = _mm_add_epi16(v, _mm_load_si128((const __m128i *) (added[j] + i)));
+        }
+        for (int j = 0; j < removed_count; ++j) {
+            v = _mm_sub_epi16(v, _mm_load_si128((const __m128i *) (removed[j] + i)));
+        }
+        _mm_storeu_si128((__m128i *) (out + i), v);
+    }
+#else
+    for (int i = 0; i < NNUE_HIDDEN; ++i) {
+        int16_t v = in[i];
+        for (int j = 0; j < added_count; ++j) {
+            v += added[j][i];
+        }
+        for (int j = 0; j < removed_count; ++j) {
+            v -= removed[j][i];
+        }
+        out[i] = v;
+    }
+#endif
+}
+
+int crelu_dot(const int16_t *accumulator, const int16_t *weights) {
+    // Clipped to [0, NNUE_QA], the products of a lane pair still fit in 32 bits
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i qa = _mm256_set1_epi16(NNUE_QA);
+    __m256i sum = zero;
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (accumulator + i));
+        v = _mm256_min_epi16(_mm256_max_epi16(v, zero), qa);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, _mm256_load_si256((const __m256i *) (weights + i))));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return _mm_cvtsi128_si32(s);
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i qa = _mm_set1_epi16(NNUE_QA);
+    __m128i sum = zero;
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (accumulator + i));
+        v = _mm_min_epi16(_mm_max_epi16(v, zero), qa);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(v, _mm_load_si128((const __m128i *) (weights + i))));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+#else
+    int sum = 0;
+    for (int i = 0; i < NNUE_HIDDEN; ++i) {
+        sum += std::min(std::max(int(accumulator[i]), 0), NNUE_QA) * weights[i];
+    }
+    return sum;
+#endif
+}
+
+bool load_nnue(std::string file_name) {
+    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::cout << "info string Could not open " << file_name << std::endl;
+        return false;
+    }
+
+    // Trainers pad the file to a multiple of 64 bytes
+    std::streamoff size = file.tellg();
+    std::streamoff expected = network_values * sizeof(int16_t);
+    if (size < expected || size >= expected + 64) {
+        std::cout << "info string " << file_name << " is not a 768x" << NNUE_HIDDEN << " network" << std::endl;
+        return false;
+    }
+
+    // Read into a buffer first, a failed read keeps the previous network
+    std::vector<int16_t> values(network_values);
+    file.seekg(0);
+    if (!file.read((char *) values.data(), expected)) {
+        std::cout << "info string Failed to read " << file_name << std::endl;
+        return false;
+    }
+
+    const int16_t *v = values.data();
+    std::memcpy(feature_weights, v, sizeof(feature_weights));
+    v += NNUE_INPUTS * NNUE_HIDDEN;
+    std::memcpy(feature_bias, v, sizeof(feature_bias));
+    v += NNUE_HIDDEN;
+    std::memcpy(output_weights, v, sizeof(output_weights));
+    v += 2 * NNUE_HIDDEN;
+    output_bias = *v;
+
+    use_nnue = true;
+    std::cout << "info string Loaded " << file_name << std::endl;
+    return true;
+}
+
+void nnue_refresh(Position *p) {
+    if (!use_nnue) {
+        return;
+    }
+    for (Color view : {white, black}) {
+        int16_t *accumulator = p->info->accumulator[view];
+        std::memcpy(accumulator, feature_bias, sizeof(feature_bias));
+
+        Bitboard board = p->board;
+        while (board) {
+            Square sq = pop(&board);
+            const int16_t *added = feature(view, p->pieces[sq], sq);
+            update_accumulator(accumulator, accumulator, &added, 1, nullptr, 0);
+        }
+    }
+}
+
+void nnue_make_move(Position *p, Info *info, Move move, Piece piece, Piece captured) {
+    // Called at the end of make_move, the features that changed follow from
+    // the move alone so the board doesn't need to be compared
+    if (!use_nnue) {
+        return;
+    }
+    Color color = piece_color(piece);
+    Square from = move_from(move);
+    Square to = move_to(move);
+    Piece added_pieces[2], removed_pieces[2];
+    Square added_squares[2], removed_squares[2];
+    int added_count = 0, removed_count = 0;
+
+    removed_pieces[removed_count] = piece;
+    removed_squares[removed_count++] = from;
+
+    if (move_type(move) == CASTLING) {
+        added_pieces[added_count] = piece;
+        added_squares[added_count++] = to;
+        removed_pieces[removed_count] = rook(color);
+        removed_squares[removed_count++] = p->initial_rooks[color][CASTLE_TYPE[to]];
+        added_pieces[added_count] = rook(color);
+        added_squares[added_count++] = ROOK_MOVES_CASTLE_TO[to];
+    } else {
+        added_pieces[added_count] = move_type(move) == PROMOTION ? get_promotion_piece(move, color) : piece;
+        added_squares[added_count++] = to;
+        if (captured != no_piece) {
+            removed_pieces[removed_count] = captured;
+            removed_squares[removed_count++] = move_type(move) == ENPASSANT ? ENPASSANT_INDEX[to] : to;
+        }
+    }
+
+    for (Color view : {white, black}) {
+        const int16_t *added[2], *removed[2];
+        for (int i = 0; i < added_count; ++i) {
+            added[i] = feature(view, added_pieces[i], added_squares[i]);
+        }
+        for (int i = 0; i < removed_count; ++i) {
+            removed[i] = feature(view, removed_pieces[i], removed_squares[i]);
+        }
+        update_accumulator(p->info->accumulator[view], info->accumulator[view], added, added_count, removed, removed_count);
+    }
+}
+
+void nnue_copy(Info *new_info, Info *info) {
+    if (use_nnue) {
+        std::memcpy(new_info->accumulator, info->accumulator, sizeof(info->accumulator));
+    }
+}
+
+int nnue_evaluate(Position *p) {
+    Info *info = p->info;
+    int64_t sum = output_bias +
+                  crelu_dot(info->accumulator[p->color], output_weights) +
+                  crelu_dot(info->accumulator[~p->color], output_weights + NNUE_HIDDEN);
+    int score = int(sum * NNUE_SCALE / (NNUE_QA * NNUE_QB));
+
+    // Keep clear of tablebase and mate scores
+    return std::max(-TB_WIN + 1, std::min(TB_WIN - 1, score));
+}
+
+#endif
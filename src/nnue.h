@@ -0,0 +1,46 @@
+/*
+    Defenchess, a chess engine
+    Copyright 2017-2019 Can Cetin, Dogac Eldenk
+
+    Defenchess is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Defenchess is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NNUE_H
+#define NNUE_H
+
+#ifdef __NNUE__
+
+#include <string>
+
+#include "const.h"
+
+// A 768 -> 2x256 -> 1 network. Inputs are the 12 piece types on 64 squares,
+// seen from each side with the board flipped for black. The side to move's
+// accumulator comes first in the hidden layer, which is clipped to [0, NNUE_QA].
+const int NNUE_INPUTS = 768;
+const int NNUE_QA = 255;    // Quantization of the accumulator
+const int NNUE_QB = 64;     // Quantization of the output weights
+const int NNUE_SCALE = 400; // Centipawns of an output of 1.0
+
+extern bool use_nnue;
+
+bool load_nnue(std::string file_name);
+void nnue_refresh(Position *p);
+void nnue_make_move(Position *p, Info *info, Move move, Piece piece, Piece captured);
+void nnue_copy(Info *new_info, Info *info);
+int nnue_evaluate(Position *p);
+
+#endif
+
+#endif
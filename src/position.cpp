@@ -22,6 +22,7 @@
 #include "bitboard.h"
 #include "move_utils.h"
 #include "move.h"
+#include "nnue.h"
 
 void init_castling_rights(Position *p) {
     // black_queenside | black_kingside | white_queenside | white_kingside
@@ -316,6 +317,9 @@ Position* import_fen(std::string fen, int thread_id){
     calculate_score(p);
     calculate_hash(p);
     calculate_material(p);
+#ifdef __NNUE__
+    nnue_refresh(p);
+#endif
     p->my_thread = t;
     return p;
 }
@@ -382,6 +386,9 @@ Position* start_pos(){
     calculate_score(p);
     calculate_hash(p);
     calculate_material(p);
+#ifdef __NNUE__
+    nnue_refresh(p);
+#endif
     p->my_thread = &main_thread;
     info->last_irreversible = 0;
     return p;
@@ -59,8 +59,9 @@ void init_values() {
     piece_values[white_king] = QUEEN_MID * 100;
     piece_values[black_king] = QUEEN_MID * 100;
 
-    for (int i = 0; i < 12; i++) {
-        for (int j = 0; j < 14; j++) {
+    // Rows cover no_piece too, quiet promotions are scored with the captures
+    for (int i = 0; i < NUM_PIECE; i++) {
+        for (int j = 0; j < NUM_PIECE; j++) {
             mvvlva_values[i][j] = piece_values[i] - j;
         }
     }
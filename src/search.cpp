@@ -16,10 +16,11 @@
     along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <atomic>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sys/time.h>
-#include <thread>
-#include <set>
 
 #include "bitboard.h"
 #include "eval.h"
@@ -31,9 +32,11 @@
 #include "search.h"
 #include "see.h"
 #include "tb.h"
+#include "thread.h"
 #include "tt.h"
+#include "uci.h"
 
-struct timeval curr_time, start_ts;
+struct timeval curr_time, start_ts, go_ts;
 
 int timer_count = 1024,
     myremain = 10000,
@@ -41,20 +44,66 @@ int timer_count = 1024,
     think_depth_limit = MAX_PLY;
 
 bool is_movetime = false;
+SearchLimits limits;
 
 volatile bool is_timeout = false,
-              quit_application = false,
-              is_searching = false,
               is_pondering = false;
 
+int smp_skip = SKIP_TABLE;
+
+// Helper depth skipping, thread i searches depth d unless ((d + phase) / size) is odd
+const int skip_size[20]  = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+const int skip_phase[20] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+// Positions close to the root that some thread is currently searching
+typedef struct Breadcrumb {
+    std::atomic<SearchThread*> thread;
+    std::atomic<uint64_t>      hash;
+} Breadcrumb;
+
+const int breadcrumb_size = 1024;
+Breadcrumb breadcrumbs[breadcrumb_size];
+
+struct SearchMarker {
+    // Marks the position as being searched by this thread for the lifetime
+    // of the marker, or notes that another thread is already searching it
+    Breadcrumb *location;
+    bool owning;
+    bool other_thread;
+
+    SearchMarker(SearchThread *my_thread, uint64_t hash, int ply) {
+        location = num_threads > 1 && ply < 8 ? &breadcrumbs[hash & (breadcrumb_size - 1)] : nullptr;
+        owning = other_thread = false;
+        if (!location) {
+            return;
+        }
+
+        SearchThread *owner = location->thread.load(std::memory_order_relaxed);
+        if (owner == nullptr) {
+            location->thread.store(my_thread, std::memory_order_relaxed);
+            location->hash.store(hash, std::memory_order_relaxed);
+            owning = true;
+        } else if (owner != my_thread && location->hash.load(std::memory_order_relaxed) == hash) {
+            other_thread = true;
+        }
+    }
+
+    ~SearchMarker() {
+        if (owning) {
+            location->thread.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+};
+
 Move latest_pv, latest_ponder;
 Move main_pv[MAX_PLY + 1];
-std::set<Move> root_moves;
+int multi_pv = 1;
+const uint64_t effort_percent = 90;
 
-void print_pv(Position *p, Metadata *md) {
+void print_pv(Position *p, Move *pv) {
     int i = 0;
-    while (md->pv[i] != no_move) {
-        std::cout << move_to_str(p, md->pv[i++]) << " ";
+    while (pv[i] != no_move) {
+        std::cout << move_to_str(p, pv[i++]) << " ";
     }
 }
 
@@ -68,13 +117,48 @@ void set_pv(Move move, Metadata *md) {
     md->pv[i] = no_move;
 }
 
-void set_main_pv(Metadata *md) {
+void copy_pv(Move *dest, Move *src) {
     int i = 0;
-    while (md->pv[i] != no_move) {
-        main_pv[i] = md->pv[i];
+    while (src[i] != no_move) {
+        dest[i] = src[i];
         ++i;
     }
-    main_pv[i] = no_move;
+    dest[i] = no_move;
+}
+
+void set_main_pv(Metadata *md) {
+    copy_pv(main_pv, md->pv);
+}
+
+bool root_move_compare(const RootMove &lhs, const RootMove &rhs) {
+    if (lhs.score != rhs.score) {
+        return lhs.score > rhs.score;
+    }
+    return lhs.previous_score > rhs.previous_score;
+}
+
+bool is_search_move(Move move) {
+    return limits.searchmoves.empty() ||
+           std::find(limits.searchmoves.begin(), limits.searchmoves.end(), move) != limits.searchmoves.end();
+}
+
+void add_root_move(SearchThread *t, Move move) {
+    RootMove *rm = &t->root_moves[t->root_move_count++];
+    rm->move = move;
+    rm->score = rm->previous_score = -MATE;
+    rm->nodes = 0;
+    rm->pv[0] = move;
+    rm->pv[1] = no_move;
+}
+
+RootMove *find_root_move(SearchThread *t, Move move) {
+    // Moves of the lines already searched at this depth are skipped
+    for (int i = t->pv_index; i < t->root_move_count; ++i) {
+        if (t->root_moves[i].move == move) {
+            return &t->root_moves[i];
+        }
+    }
+    return nullptr;
 }
 
 bool is_draw(Position *p) {
@@ -117,6 +201,16 @@ int draw_score(SearchThread *my_thread) {
 }
 
 void update_history(int *history, int bonus) {
+    // The butterfly table may be shared between threads, concurrent updates
+    // can get lost but each one stays within the bounds
+    int value = __atomic_load_n(history, __ATOMIC_RELAXED);
+    value += bonus - value * std::abs(bonus) / 16384;
+    assert(value <= 16384 && value >= -16384);
+    __atomic_store_n(history, value, __ATOMIC_RELAXED);
+}
+
+void update_history(int16_t *history, int bonus) {
+    // Same bounds as above, which fit in 16 bits
     *history += bonus - (*history) * std::abs(bonus) / 16384;
     assert(*history <= 16384 && *history >= -16384);
 }
@@ -142,11 +236,11 @@ void save_killer(Position *p, Metadata *md, Move move, int depth, Move *quiets,
         Square prev_to = move_to((md-1)->current_move);
         my_thread->counter_moves[p->pieces[prev_to]][prev_to] = move;
 
-        update_history(&(md-1)->counter_move_history[piece][to], bonus);
+        update_history(&(md-1)->counter_move_history[cmh_index(piece, to)], bonus);
     }
 
     if (fmh_valid) {
-        update_history(&(md-2)->counter_move_history[piece][to], bonus);
+        update_history(&(md-2)->counter_move_history[cmh_index(piece, to)], bonus);
     }
 
     for (int i = 0; i < quiets_count; ++i) {
@@ -159,15 +253,103 @@ void save_killer(Position *p, Metadata *md, Move move, int depth, Move *quiets,
         update_history(&my_thread->history[color][quiet_from][quiet_to], -bonus);
 
         if (cmh_valid) {
-            update_history(&(md-1)->counter_move_history[quiet_piece][quiet_to], -bonus);
+            update_history(&(md-1)->counter_move_history[cmh_index(quiet_piece, quiet_to)], -bonus);
         }
         if (fmh_valid) {
-            update_history(&(md-2)->counter_move_history[quiet_piece][quiet_to], -bonus);
+            update_history(&(md-2)->counter_move_history[cmh_index(quiet_piece, quiet_to)], -bonus);
         }
     }
 }
 
+bool is_move_str(std::string s) {
+    return s.length() >= 4 && s[0] >= 'a' && s[0] <= 'h' && s[1] >= '1' && s[1] <= '8';
+}
+
+SearchLimits parse_limits(Position *p, std::vector<std::string> word_list) {
+    // Keywords can come in any order and combination
+    SearchLimits l = {};
+
+    for (unsigned i = 1; i < word_list.size(); ++i) {
+        std::string word = word_list[i];
+        bool has_value = i + 1 < word_list.size();
+
+        if (word == "infinite") {
+            l.infinite = true;
+        } else if (word == "ponder") {
+            l.ponder = true;
+        } else if (word == "searchmoves") {
+            while (i + 1 < word_list.size() && is_move_str(word_list[i + 1])) {
+                l.searchmoves.push_back(parse_move(p, word_list[++i]));
+            }
+        } else if (!has_value) {
+            break;
+        } else if (word == "wtime") {
+            l.time[white] = stoi(word_list[++i]);
+            l.use_clock = true;
+        } else if (word == "btime") {
+            l.time[black] = stoi(word_list[++i]);
+            l.use_clock = true;
+        } else if (word == "winc") {
+            l.inc[white] = stoi(word_list[++i]);
+        } else if (word == "binc") {
+            l.inc[black] = stoi(word_list[++i]);
+        } else if (word == "movestogo") {
+            l.movestogo = stoi(word_list[++i]);
+        } else if (word == "movetime") {
+            l.movetime = stoi(word_list[++i]);
+        } else if (word == "depth") {
+            l.depth = std::min(std::max(stoi(word_list[++i]), 1), int(MAX_PLY));
+        } else if (word == "mate") {
+            l.mate = stoi(word_list[++i]);
+        } else if (word == "nodes") {
+            l.nodes = std::stoull(word_list[++i]);
+        }
+    }
+    return l;
+}
+
+void init_time(Position *p, std::vector<std::string> word_list) {
+    // is_timeout and is_pondering are reset by launch_search
+    limits = parse_limits(p, word_list);
+    is_movetime = false;
+    timer_count = 1024;
+
+    if (word_list.size() <= 1) {
+        myremain = 10000;
+        total_remaining = 10000;
+        return;
+    }
+
+    think_depth_limit = limits.depth ? limits.depth : MAX_PLY;
+
+    if (limits.use_clock && !limits.infinite) {
+        TTime t = get_myremain(
+            limits.inc[p->color],
+            limits.time[p->color],
+            limits.movestogo,
+            p->my_thread->root_ply
+        );
+        myremain = t.optimum_time;
+        total_remaining = t.maximum_time;
+    } else {
+        myremain = 3600000;
+        total_remaining = myremain;
+    }
+
+    if (limits.movetime) {
+        myremain = std::min(myremain, limits.movetime * 99 / 100);
+        total_remaining = myremain;
+        is_movetime = true;
+    }
+}
+
 void check_time(Position *p) {
+    SearchThread *my_thread = p->my_thread;
+    if (deterministic && num_threads > 1 && --my_thread->turn_count == 0) {
+        my_thread->turn_count = turn_quantum;
+        pass_turn(my_thread);
+    }
+
     if (!is_main_thread(p)) {
         return;
     }
@@ -176,7 +358,11 @@ void check_time(Position *p) {
 
     if (timer_count == 0) {
         gettimeofday(&curr_time, nullptr);
-        if (time_passed() >= total_remaining && !is_pondering) {
+        if (time_passed() >= total_remaining && !is_pondering && !deterministic) {
+            is_timeout = true;
+        }
+
+        if (limits.nodes && sum_nodes() >= limits.nodes) {
             is_timeout = true;
         }
 
@@ -212,12 +398,13 @@ int alpha_beta_quiescence(Position *p, Metadata *md, int alpha, int beta, int de
     Move tte_move = no_move;
     int tte_score = UNDEFINED;
     bool tt_hit;
-    TTEntry *tte = get_tte(info->hash, tt_hit);
-    uint8_t tt_flag = tte_flag(tte);
+    TTEntry tte;
+    uint64_t *slot = get_tte(&my_thread->tt_stats, info->hash, depth, tte, tt_hit);
+    uint8_t tt_flag = tte_flag(&tte);
     if (tt_hit) {
-        tte_move = tte->move;
-        if (tte->depth >= tte_depth) {
-            tte_score = tt_to_score(tte->score, ply);
+        tte_move = tte.move;
+        if (tte.depth >= tte_depth) {
+            tte_score = tt_to_score(tte.score, ply);
             if (!is_pv &&
                 (tt_flag == FLAG_EXACT ||
                 (tt_flag == FLAG_BETA && tte_score >= beta) ||
@@ -230,13 +417,16 @@ int alpha_beta_quiescence(Position *p, Metadata *md, int alpha, int beta, int de
     int best_score;
     if (!in_check) {
         bool is_null = (md-1)->current_move == null_move;
-        if (tt_hit && tte->static_eval != UNDEFINED) {
-            md->static_eval = best_score = tte->static_eval;
+        if (tt_hit && tte.static_eval != UNDEFINED) {
+            md->static_eval = best_score = tte.static_eval;
         } else if (is_null) {
             assert((md-1)->static_eval != UNDEFINED);
             md->static_eval = best_score = tempo * 2 - (md-1)->static_eval;
         } else {
-            md->static_eval = best_score = evaluate(p);
+            // A lazy evaluation is only a bound, it isn't kept as the static eval
+            bool exact;
+            best_score = evaluate(p, alpha, beta, &exact);
+            md->static_eval = exact ? best_score : UNDEFINED;
         }
         if (best_score >= beta) {
             return best_score;
@@ -274,21 +464,21 @@ int alpha_beta_quiescence(Position *p, Metadata *md, int alpha, int beta, int de
         md->current_move = move;
         Square to = move_to(move);
         Piece piece = p->pieces[to];
-        md->counter_move_history = p->my_thread->counter_move_history[piece][to];
+        md->counter_move_history = cmh_table(p->my_thread, piece, to);
         int score = -alpha_beta_quiescence(p, md+1, -beta, -alpha, depth - 1, is_checked(p));
         undo_move(p, move);
 
         if (score > best_score) {
             best_score = score;
             if (score > alpha) {
-                if (is_pv && is_main_thread(p)) {
+                if (is_pv) {
                     set_pv(move, md);
                 }
                 best_move = move;
                 if (is_pv && score < beta) {
                     alpha = score;
                 } else {
-                    set_tte(info->hash, tte, move, tte_depth, score_to_tt(score, ply), md->static_eval, FLAG_BETA);
+                    set_tte(&my_thread->tt_stats, info->hash, slot, move, tte_depth, score_to_tt(score, ply), md->static_eval, FLAG_BETA);
                     return score;
                 }
             }
@@ -300,7 +490,7 @@ int alpha_beta_quiescence(Position *p, Metadata *md, int alpha, int beta, int de
     }
 
     uint8_t flag = is_pv && best_move ? FLAG_EXACT : FLAG_ALPHA;
-    set_tte(info->hash, tte, best_move, tte_depth, score_to_tt(best_score, ply), md->static_eval, flag);
+    set_tte(&my_thread->tt_stats, info->hash, slot, best_move, tte_depth, score_to_tt(best_score, ply), md->static_eval, flag);
     assert(best_score >= -MATE && best_score <= MATE);
     return best_score;
 }
@@ -358,12 +548,13 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
     Move tte_move = no_move;
     int tte_score = UNDEFINED;
     bool tt_hit;
-    TTEntry *tte = get_tte(pos_hash, tt_hit);
-    uint8_t tt_flag = tte_flag(tte);
+    TTEntry tte;
+    uint64_t *slot = get_tte(&my_thread->tt_stats, pos_hash, depth, tte, tt_hit);
+    uint8_t tt_flag = tte_flag(&tte);
     if (tt_hit) {
-        tte_move = tte->move;
-        if (tte->depth >= depth) {
-            tte_score = tt_to_score(tte->score, ply);
+        tte_move = tte.move;
+        if (tte.depth >= depth) {
+            tte_score = tt_to_score(tte.score, ply);
             if (!is_pv &&
                 (tt_flag == FLAG_EXACT ||
                 (tt_flag == FLAG_BETA && tte_score >= beta) ||
@@ -381,15 +572,15 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
             int tb_score = wdl == SYZYGY_LOSS ? MATED_IN_MAX_PLY + ply + 1
                          : wdl == SYZYGY_WIN  ? MATE_IN_MAX_PLY  - ply - 1 : 0;
 
-            set_tte(pos_hash, tte, no_move, std::min(depth + SYZYGY_LARGEST, MAX_PLY - 1), score_to_tt(tb_score, ply), UNDEFINED, FLAG_EXACT);
+            set_tte(&my_thread->tt_stats, pos_hash, slot, no_move, std::min(depth + SYZYGY_LARGEST, MAX_PLY - 1), score_to_tt(tb_score, ply), UNDEFINED, FLAG_EXACT);
             return tb_score;
         }
     }
 
     bool is_null = (md-1)->current_move == null_move;
     if (!in_check) {
-        if (tt_hit && tte->static_eval != UNDEFINED) {
-            md->static_eval = tte->static_eval;
+        if (tt_hit && tte.static_eval != UNDEFINED) {
+            md->static_eval = tte.static_eval;
         } else if (is_null) {
             assert((md-1)->static_eval != UNDEFINED);
             md->static_eval = tempo * 2 - (md-1)->static_eval;
@@ -418,7 +609,7 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
 
         make_null_move(p);
         md->current_move = null_move;
-        md->counter_move_history = p->my_thread->counter_move_history[no_piece][0];
+        md->counter_move_history = cmh_table(p->my_thread, no_piece, 0);
         ++my_thread->nodes;
         int null_eval = -alpha_beta(p, md+1, -beta, -beta + 1, depth - R, false);
         undo_null_move(p);
@@ -449,7 +640,7 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
                 md->current_move = move;
                 Square to = move_to(move);
                 Piece piece = p->pieces[to];
-                md->counter_move_history = p->my_thread->counter_move_history[piece][to];
+                md->counter_move_history = cmh_table(p->my_thread, piece, to);
                 int value = -alpha_beta(p, md+1, -rbeta, -rbeta +  1, depth - 4, is_checked(p));
                 undo_move(p, move);
 
@@ -470,6 +661,8 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
 
     bool improving = !in_check && ply > 1 && (md->static_eval >= (md-2)->static_eval || (md-2)->static_eval == UNDEFINED);
 
+    SearchMarker marker(my_thread, pos_hash, ply);
+
     while ((move = next_move(&movegen, md, depth)) != no_move) {
         assert(is_pseudolegal(p, move));
         assert(is_move_valid(move));
@@ -479,7 +672,8 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
             continue;
         }
 
-        if (root_node && root_moves.find(move) == root_moves.end()) {
+        RootMove *root_move = nullptr;
+        if (root_node && !(root_move = find_root_move(my_thread, move))) {
             continue;
         }
 
@@ -498,7 +692,7 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
             excluded_move == no_move &&
             std::abs(tte_score) < TB_WIN &&
             (tt_flag & FLAG_BETA) &&
-            tte->depth >= depth - 2 &&
+            tte.depth >= depth - 2 &&
             is_legal(p, move))
         {
             assert(tte_score != UNDEFINED);
@@ -537,12 +731,13 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
             continue;
         }
 
+        uint64_t nodes_before = my_thread->nodes;
         make_move(p, move);
         ++my_thread->nodes;
         md->current_move = move;
         Square to = move_to(move);
         Piece piece = p->pieces[to];
-        md->counter_move_history = p->my_thread->counter_move_history[piece][to];
+        md->counter_move_history = cmh_table(p->my_thread, piece, to);
         if (!capture_or_promo && quiets_count < 64) {
             quiets[quiets_count++] = move;
         }
@@ -561,6 +756,11 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
                     ++reduction;
                 }
 
+                // Leave the subtree to the thread that is already searching it
+                if (marker.other_thread) {
+                    ++reduction;
+                }
+
                 if (move == md->killers[0] || move == md->killers[1] || move == movegen.counter_move) {
                     --reduction;
                 }
@@ -586,10 +786,22 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
             return TIMEOUT;
         }
 
+        // Moves that don't raise alpha only have an upper bound, they sort below the others
+        if (root_node) {
+            root_move->nodes += my_thread->nodes - nodes_before;
+            if (num_moves == 1 || score > alpha) {
+                root_move->score = score;
+                root_move->pv[0] = move;
+                copy_pv(root_move->pv + 1, (md+1)->pv);
+            } else {
+                root_move->score = -MATE;
+            }
+        }
+
         if (score > best_score) {
             best_score = score;
             if (score > alpha) {
-                if (is_pv && is_main_thread(p)) {
+                if (is_pv) {
                     set_pv(move, md);
                 }
                 best_move = move;
@@ -600,7 +812,7 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
                         save_killer(p, md, move, depth, quiets, quiets_count - 1);
                     }
                     if (excluded_move == no_move) {
-                        set_tte(pos_hash, tte, move, depth, score_to_tt(score, ply), md->static_eval, FLAG_BETA);
+                        set_tte(&my_thread->tt_stats, pos_hash, slot, move, depth, score_to_tt(score, ply), md->static_eval, FLAG_BETA);
                     }
                     return score;
                 }
@@ -614,7 +826,7 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
 
     if (excluded_move == no_move) {
         uint8_t flag = is_pv && best_move ? FLAG_EXACT : FLAG_ALPHA;
-        set_tte(pos_hash, tte, best_move, depth, score_to_tt(best_score, ply), md->static_eval, flag);
+        set_tte(&my_thread->tt_stats, pos_hash, slot, best_move, depth, score_to_tt(best_score, ply), md->static_eval, flag);
     }
     if (!in_check && best_move && !is_capture_or_promotion(p, best_move)) {
         save_killer(p, md, best_move, depth, quiets, quiets_count - 1);
@@ -623,12 +835,12 @@ int alpha_beta(Position *p, Metadata *md, int alpha, int beta, int depth, bool i
     return best_score;
 }
 
-void print_info(Position *p, Metadata *md, int depth, int score, int alpha, int beta, bool pv_printed) {
+void print_info(Position *p, Move *pv, int multipv, int depth, int score, int alpha, int beta, bool pv_printed) {
     SearchThread *my_thread = p->my_thread;
     gettimeofday(&curr_time, nullptr);
     int time_taken = time_passed();
     uint64_t tb_hits = sum_tb_hits();
-    std::cout << "info depth " << depth << " seldepth " << (my_thread->selply + 1) << " multipv 1 ";
+    std::cout << "info depth " << depth << " seldepth " << (my_thread->selply + 1) << " multipv " << multipv << " ";
     std::cout << "tbhits " << tb_hits << " score ";
 
     if (score <= MATED_IN_MAX_PLY) {
@@ -650,7 +862,7 @@ void print_info(Position *p, Metadata *md, int depth, int score, int alpha, int
     uint64_t nodes = sum_nodes();
     std::cout << " nodes " << nodes <<  " nps " << nodes*1000/(time_taken+1) << " time " << time_taken << " pv ";
     if (pv_printed) {
-        print_pv(p, md);
+        print_pv(p, pv);
     } else {
         // For fail lows, only print the first move of the main pv
         std::cout << move_to_str(p, main_pv[0]);
@@ -665,69 +877,110 @@ void thread_think(SearchThread *my_thread, bool in_check) {
 
     Move pv_at_depth[MAX_PLY * 2];
 
-    int previous = -MATE;
+    struct timeval search_start;
+    gettimeofday(&search_start, nullptr);
+    my_thread->start_latency = time_passed_us(go_ts, search_start);
+
     int score = -MATE;
     int init_remain = myremain;
     int init_total_remaining = total_remaining;
-    int depth = 0;
+    int helper = my_thread->thread_id - 1;
+    my_thread->completed_depth = 0;
 
-    while (++depth <= think_depth_limit) {
-        my_thread->selply = 0;
+    RootMove *root_moves = my_thread->root_moves;
+    int root_move_count = my_thread->root_move_count;
+    int pv_count = std::min(multi_pv, root_move_count);
 
-        int aspiration = 10;
-        int alpha = -MATE;
-        int beta = MATE;
+    // Odd helpers stay a depth ahead of everyone else
+    int depth = smp_skip == SKIP_ODD && helper >= 0 && helper % 2 == 0 ? 1 : 0;
 
-        if (depth >= 5) {
-            alpha = std::max(previous - aspiration, -MATE);
-            beta = std::min(previous + aspiration, MATE);
+    while (++depth <= think_depth_limit) {
+        if (smp_skip == SKIP_TABLE && !is_main) {
+            int i = helper % 20;
+            if (((depth + skip_phase[i]) / skip_size[i]) % 2) {
+                continue;
+            }
         }
 
-        bool failed_low = false;
+        for (int i = 0; i < root_move_count; ++i) {
+            root_moves[i].previous_score = root_moves[i].score;
+        }
 
-        while (true) {
-            score = alpha_beta(p, md, alpha, beta, depth, in_check);
+        my_thread->selply = 0;
+        bool failed_low = false;
 
-            if (is_timeout) {
-                break;
+        // Each pv line gets its own aspiration window, excluding the moves of the lines above it
+        for (my_thread->pv_index = 0; my_thread->pv_index < pv_count; ++my_thread->pv_index) {
+            int pv_index = my_thread->pv_index;
+            int previous = root_moves[pv_index].previous_score;
+            int aspiration = 10;
+            int alpha = -MATE;
+            int beta = MATE;
+
+            if (depth >= 5) {
+                alpha = std::max(previous - aspiration, -MATE);
+                beta = std::min(previous + aspiration, MATE);
             }
 
-            // Only set main pv when it's not a fail low
-            if (is_main && score > alpha) {
-                set_main_pv(md);
-            }
+            while (true) {
+                score = alpha_beta(p, md, alpha, beta, depth, in_check);
+                std::stable_sort(root_moves + pv_index, root_moves + root_move_count, root_move_compare);
+
+                if (is_timeout) {
+                    break;
+                }
+
+                // Only set main pv when it's not a fail low
+                if (is_main && pv_index == 0 && score > alpha) {
+                    set_main_pv(md);
+                }
 
-            if (is_main && (score <= alpha || score >= beta) && depth > 12) {
-                print_info(p, md, depth, score, alpha, beta, false);
+                if (is_main && pv_index == 0 && (score <= alpha || score >= beta) && depth > 12) {
+                    print_info(p, md->pv, 1, depth, score, alpha, beta, false);
+                }
+
+                if (score <= alpha) {
+                    beta = (alpha + beta) / 2;
+                    alpha = std::max(score - aspiration, -MATE);
+                    failed_low = failed_low || pv_index == 0;
+                } else if (score >= beta) {
+                    beta = std::min(score + aspiration, MATE);
+                } else {
+                    break;
+                }
+
+                aspiration += aspiration / 2;
+                assert(alpha >= -MATE && beta <= MATE);
             }
 
-            if (score <= alpha) {
-                beta = (alpha + beta) / 2;
-                alpha = std::max(score - aspiration, -MATE);
-                failed_low = true;
-            } else if (score >= beta) {
-                beta = std::min(score + aspiration, MATE);
-            } else {
+            if (is_timeout) {
                 break;
             }
-
-            aspiration += aspiration / 2;
-            assert(alpha >= -MATE && beta <= MATE);
+            std::stable_sort(root_moves, root_moves + pv_index + 1, root_move_compare);
         }
 
-        previous = score;
-
         if (is_timeout) {
             break;
         }
 
+        my_thread->completed_depth = depth;
+        my_thread->completed_score = root_moves[0].score;
+        copy_pv(my_thread->completed_pv, root_moves[0].pv);
+
         if (!is_main) {
             continue;
         }
 
-        print_info(p, md, depth, score, alpha, beta, true);
+        // A lower line can overtake the first one, the best line always leads
+        if (pv_count > 1) {
+            copy_pv(main_pv, root_moves[0].pv);
+        }
 
-        if (time_passed() > myremain && !is_pondering) {
+        for (int i = 0; i < pv_count; ++i) {
+            print_info(p, root_moves[i].pv, i + 1, depth, root_moves[i].score, -MATE, MATE, true);
+        }
+
+        if (time_passed() > myremain && !is_pondering && !deterministic) {
             is_timeout = true;
             break;
         }
@@ -749,7 +1002,69 @@ void thread_think(SearchThread *my_thread, bool in_check) {
                 total_remaining = std::max(init_total_remaining, total_remaining);
             }
         }
+
+        // Stop once a mate within the requested number of moves is found
+        if (limits.mate && root_moves[0].score >= MATE_IN_MAX_PLY && (MATE - root_moves[0].score) / 2 + 1 <= limits.mate) {
+            is_timeout = true;
+            break;
+        }
+
+        // Past half the time, stop if nearly all nodes went into the best move
+        // as the other moves are unlikely to overtake it. Only a clock search
+        // has a real budget, the others run on a placeholder hour.
+        if (depth >= 10 && pv_count == 1 && !is_movetime && !is_pondering && !deterministic &&
+            limits.use_clock && !limits.infinite && !limits.depth && !limits.nodes && !limits.mate &&
+            root_moves[0].nodes * 100 >= my_thread->nodes * effort_percent &&
+            time_passed() > myremain / 2) {
+            is_timeout = true;
+            break;
+        }
+    }
+}
+
+int64_t thread_votes(SearchThread *t, int min_score) {
+    // Every thread that finished an iteration backs its first move, deeper
+    // and better scoring iterations count for more
+    int64_t votes = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        SearchThread *other = get_thread(i);
+        if (other->completed_depth > 0 && other->completed_pv[0] == t->completed_pv[0]) {
+            votes += int64_t(other->completed_score - min_score + 20) * other->completed_depth;
+        }
     }
+    return votes;
+}
+
+SearchThread *pick_best_thread() {
+    SearchThread *best_thread = &main_thread;
+    if (num_threads == 1 || multi_pv > 1 || main_thread.completed_depth == 0) {
+        return best_thread;
+    }
+
+    int min_score = MATE;
+    for (int i = 0; i < num_threads; ++i) {
+        SearchThread *t = get_thread(i);
+        if (t->completed_depth > 0) {
+            min_score = std::min(min_score, t->completed_score);
+        }
+    }
+
+    int64_t best_votes = thread_votes(best_thread, min_score);
+    for (int i = 1; i < num_threads; ++i) {
+        SearchThread *t = get_thread(i);
+        if (t->completed_depth == 0 || t->completed_pv[0] == no_move) {
+            continue;
+        }
+
+        // Once a mate is found, only a shorter mate replaces it
+        int64_t votes = thread_votes(t, min_score);
+        if (best_thread->completed_score >= MATE_IN_MAX_PLY ? t->completed_score > best_thread->completed_score
+                                                             : votes > best_votes) {
+            best_thread = t;
+            best_votes = votes;
+        }
+    }
+    return best_thread;
 }
 
 void think(Position *p, std::vector<std::string> word_list) {
@@ -764,33 +1079,37 @@ void think(Position *p, std::vector<std::string> word_list) {
     Metadata *md = &main_thread.metadatas[2]; // Start from 2 so that we can do (md-2) without checking
 
     // Clear root moves
-    root_moves.clear();
+    main_thread.root_move_count = 0;
 
-    int wdl = probe_syzygy_dtz(p, &tb_move);
+    // Restricting the root moves rules out the tablebase move
+    int wdl = limits.searchmoves.empty() ? probe_syzygy_dtz(p, &tb_move) : SYZYGY_FAIL;
     if (wdl != SYZYGY_FAIL) {
         // Return draws immediately
         if (wdl == SYZYGY_DRAW) {
             while (is_pondering) {}
+            search_active = false;
             std::cout << "info score cp 0" << std::endl;
             std::cout << "bestmove " << move_to_str(p, tb_move) << std::endl;
             return;
         }
-        root_moves.insert(tb_move);
+        add_root_move(&main_thread, tb_move);
     } else {
         MoveGen movegen = new_movegen(p, md, no_move, NORMAL_SEARCH, 0, in_check);
         Move move;
         while ((move = next_move(&movegen, md, 0)) != no_move) {
-            if (is_legal(p, move)) {
-                root_moves.insert(move);
+            if (is_legal(p, move) && is_search_move(move)) {
+                add_root_move(&main_thread, move);
             }
         }
-        if (root_moves.size() == 1) {
+        if (main_thread.root_move_count == 1) {
             while (is_pondering) {}
-            std::cout << "bestmove " << move_to_str(p, *root_moves.begin()) << std::endl;
+            search_active = false;
+            std::cout << "bestmove " << move_to_str(p, main_thread.root_moves[0].move) << std::endl;
             return;
         }
-        if (root_moves.size() == 0) {
+        if (main_thread.root_move_count == 0) {
             while (is_pondering) {}
+            search_active = false;
             std::cout << "bestmove none" << std::endl;
             return;
         }
@@ -798,26 +1117,46 @@ void think(Position *p, std::vector<std::string> word_list) {
 
     gettimeofday(&start_ts, nullptr);
 
-    std::thread *threads = new std::thread[num_threads];
     initialize_nodes();
+    if (deterministic) {
+        start_turns();
+    }
 
-    is_searching = true;
-    for (int i = 0; i < num_threads; ++i) {
-        threads[i] = std::thread(thread_think, get_thread(i), in_check);
+    for (int i = 1; i < num_threads; ++i) {
+        SearchThread *t = get_thread(i);
+        std::memcpy(t->root_moves, main_thread.root_moves, main_thread.root_move_count * sizeof(RootMove));
+        t->root_move_count = main_thread.root_move_count;
+        wake_thread(t);
     }
 
-    // Stop threads
-    for (int i = 0; i < num_threads; ++i) {
-        threads[i].join();
+    thread_think(&main_thread, in_check);
+
+    // Helpers don't decide when the search ends, stop them once the main thread is done
+    is_timeout = true;
+    if (deterministic) {
+        leave_turns(&main_thread);
     }
 
-    delete[] threads;
+    // Wait for the helpers to go back to sleep
+    for (int i = 1; i < num_threads; ++i) {
+        wait_thread(get_thread(i));
+    }
 
     // If search is stopped for some reason while pondering, wait before printing best move
     while (is_pondering) {}
 
+    // A helper that got deeper or found a better move overrides the main thread
+    SearchThread *best_thread = pick_best_thread();
+    if (best_thread != &main_thread) {
+        copy_pv(main_pv, best_thread->completed_pv);
+        latest_pv = main_pv[0];
+        latest_ponder = main_pv[1];
+        print_info(&best_thread->position, main_pv, 1, best_thread->completed_depth, best_thread->completed_score, -MATE, MATE, true);
+    }
+
     gettimeofday(&curr_time, nullptr);
     std::cout << "info time " << time_passed() << std::endl;
+    search_active = false;
     std::cout << "bestmove " << move_to_str(p, main_pv[0]);
 
     if (main_pv[0] == latest_pv && is_move_valid(latest_ponder)) {
@@ -825,31 +1164,131 @@ void think(Position *p, std::vector<std::string> word_list) {
     }
 
     std::cout << std::endl;
+}
+
+typedef struct BenchResult {
+    std::string fen;
+    int         time;
+    uint64_t    nodes;
+    uint64_t    tt_probes;
+    uint64_t    tt_hits;
+} BenchResult;
+
+std::vector<std::string> read_bench_positions(std::string fen_file) {
+    std::vector<std::string> positions;
+    if (fen_file.empty()) {
+        positions.assign(benchmarks, benchmarks + 36);
+        return positions;
+    }
 
-    if (quit_application) {
-        exit(EXIT_SUCCESS);
+    std::ifstream in(fen_file);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line[line.length() - 1] == '\r') {
+            line.erase(line.length() - 1);
+        }
+        if (!line.empty()) {
+            positions.push_back(line);
+        }
+    }
+    if (positions.empty()) {
+        std::cout << "info string No positions in " << fen_file << ", using the default ones" << std::endl;
+        positions.assign(benchmarks, benchmarks + 36);
+    }
+    return positions;
+}
+
+void write_bench_report(std::string out_file, int depth, int threads, int hash, std::vector<BenchResult> &results,
+                        int time_taken, uint64_t nodes) {
+    // Format follows the extension, json or csv
+    std::ofstream out(out_file);
+    if (!out) {
+        std::cout << "info string Failed to write " << out_file << std::endl;
+        return;
+    }
+
+    bool json = out_file.size() >= 5 && out_file.compare(out_file.size() - 5, 5, ".json") == 0;
+    if (json) {
+        out << "{\n  \"depth\": " << depth << ", \"threads\": " << threads << ", \"hash\": " << hash << ",\n";
+        out << "  \"time\": " << time_taken << ", \"nodes\": " << nodes << ", \"nps\": " << nodes * 1000 / (time_taken + 1) << ",\n";
+        out << "  \"positions\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            BenchResult *r = &results[i];
+            out << "    {\"fen\": \"" << r->fen << "\", \"time\": " << r->time << ", \"nodes\": " << r->nodes
+                << ", \"nps\": " << r->nodes * 1000 / (r->time + 1) << ", \"tt_hit_rate\": " << r->tt_hits * 100 / (r->tt_probes + 1) << "}"
+                << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    } else {
+        out << "fen,time,nodes,nps,tt_hit_rate\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            BenchResult *r = &results[i];
+            out << r->fen << "," << r->time << "," << r->nodes << "," << r->nodes * 1000 / (r->time + 1) << ","
+                << r->tt_hits * 100 / (r->tt_probes + 1) << "\n";
+        }
+        out << "total," << time_taken << "," << nodes << "," << nodes * 1000 / (time_taken + 1) << ",\n";
     }
-    is_searching = false;
 }
 
-void bench() {
+uint64_t bench(int depth, int threads, int hash, std::string fen_file, std::string out_file) {
     uint64_t nodes = 0;
+    uint64_t latency = 0;
     std::vector<std::string> empty_word_list;
+    std::vector<std::string> positions = read_bench_positions(fen_file);
+    std::vector<BenchResult> results;
+
+    int tmp_threads = num_threads;
+    int tmp_hash = int(table.tt_size / one_mb);
+    threads = threads > 0 ? std::min(threads, MAX_THREADS) : num_threads;
+    hash = hash > 0 ? hash : tmp_hash;
+    if (threads != num_threads) {
+        reset_threads(threads);
+    }
+    if (hash != tmp_hash) {
+        reset_tt(hash);
+    }
 
     struct timeval bench_start, bench_end;
     gettimeofday(&bench_start, nullptr);
     int tmp_depth = think_depth_limit;
     int tmp_myremain = myremain;
-    think_depth_limit = 13;
+    think_depth_limit = depth;
     is_timeout = false;
 
-    for (int i = 0; i < 36; i++){
-        std::cout << "\nPosition [" << (i + 1) << "|36]\n" << std::endl;
-        Position *p = import_fen(benchmarks[i], 0);
+    int count = int(positions.size());
+    for (int i = 0; i < count; i++){
+        std::cout << "\nPosition [" << (i + 1) << "|" << count << "]\n" << std::endl;
+        import_fen(positions[i], 0);
+        if (num_threads > 1) {
+            // Helpers search copies of the root position
+            get_ready();
+        }
 
+        struct timeval position_start, position_end;
+        gettimeofday(&position_start, nullptr);
         myremain = 3600000;
-        think(p, empty_word_list);
-        nodes += main_thread.nodes;
+        launch_search(empty_word_list);
+        wait_search();
+        gettimeofday(&position_end, nullptr);
+
+        TTStats stats;
+        sum_tt_stats(&stats);
+        BenchResult r = {positions[i], bench_time(position_start, position_end), sum_nodes(), 0, 0};
+        for (int d = 0; d < tt_depth_bands; ++d) {
+            r.tt_probes += stats.probes[d];
+            r.tt_hits += stats.hits[d];
+        }
+        results.push_back(r);
+        nodes += r.nodes;
+
+        std::cout << "Position " << (i + 1) << " : time " << r.time << " nodes " << r.nodes
+                  << " nps " << r.nodes * 1000 / (r.time + 1) << " tthit " << r.tt_hits * 100 / (r.tt_probes + 1) << "%" << std::endl;
+
+        int slowest = 0;
+        for (int j = 0; j < num_threads; ++j) {
+            slowest = std::max(slowest, get_thread(j)->start_latency);
+        }
+        latency += slowest;
 
         clear_tt();
     }
@@ -863,5 +1302,130 @@ void bench() {
     std::cout << "Time  : " << time_taken << std::endl;
     std::cout << "Nodes : " << nodes << std::endl;
     std::cout << "NPS   : " << nodes * 1000 / (time_taken + 1) << std::endl;
+    std::cout << "Start : " << latency / count << " us" << std::endl;
+
+    if (!out_file.empty()) {
+        write_bench_report(out_file, depth, threads, hash, results, time_taken, nodes);
+    }
+
+    if (threads != tmp_threads) {
+        reset_threads(tmp_threads);
+    }
+    if (hash != tmp_hash) {
+        reset_tt(tmp_hash);
+    }
+    return nodes * 1000 / (time_taken + 1);
+}
+
+void bench_large_pages() {
+    // Runs the bench with regular pages first, then with huge pages
+    bool tmp_large_pages = large_pages;
+    int megabytes = int(table.tt_size / one_mb);
+    uint64_t nps[2];
+
+    for (int i = 0; i < 2; ++i) {
+        large_pages = i == 1;
+        reset_tt(megabytes);
+        nps[i] = bench();
+    }
+
+    large_pages = tmp_large_pages;
+    reset_tt(megabytes);
+
+    std::cout << "\n========================\n";
+    std::cout << "Regular pages NPS : " << nps[0] << std::endl;
+    std::cout << "Large pages NPS   : " << nps[1] << std::endl;
+    std::cout << "Difference        : " << (int64_t(nps[1]) - int64_t(nps[0])) * 100 / int64_t(nps[0] + 1) << "%" << std::endl;
 }
 
+
+int smp_bench_run(int threads, bool shared, int depth, int positions, uint64_t *nodes) {
+    // Returns the time it takes to search the first bench positions to the given depth
+    reset_threads(threads);
+    set_shared_history(shared);
+    std::vector<std::string> empty_word_list;
+
+    int time_taken = 0;
+    *nodes = 0;
+    for (int i = 0; i < positions; ++i) {
+        import_fen(benchmarks[i], 0);
+        get_ready();
+        clear_threads();
+        clear_tt();
+
+        struct timeval position_start, position_end;
+        gettimeofday(&position_start, nullptr);
+        myremain = 3600000;
+        think_depth_limit = depth;
+        launch_search(empty_word_list);
+        wait_search();
+        gettimeofday(&position_end, nullptr);
+        time_taken += bench_time(position_start, position_end);
+        *nodes += sum_nodes();
+    }
+    return time_taken;
+}
+
+void smp_bench(int depth, int positions) {
+    // Compares time to depth with private and shared butterfly histories
+    const int thread_counts[3] = {8, 32, 128};
+    int tmp_threads = num_threads;
+    bool tmp_shared = share_history;
+    int tmp_depth = think_depth_limit;
+    int tmp_myremain = myremain;
+    int times[3][2];
+
+    for (int i = 0; i < 3; ++i) {
+        for (int shared = 0; shared < 2; ++shared) {
+            uint64_t nodes;
+            times[i][shared] = smp_bench_run(thread_counts[i], shared, depth, positions, &nodes);
+        }
+    }
+
+    think_depth_limit = tmp_depth;
+    myremain = tmp_myremain;
+    reset_threads(tmp_threads);
+    set_shared_history(tmp_shared);
+    clear_threads();
+    clear_tt();
+
+    std::cout << "\n========================\n";
+    std::cout << "Depth " << depth << ", " << positions << " positions" << std::endl;
+    std::cout << "Threads   Private    Shared   Speedup" << std::endl;
+    for (int i = 0; i < 3; ++i) {
+        std::cout << std::setw(7) << thread_counts[i]
+                  << std::setw(10) << times[i][0]
+                  << std::setw(10) << times[i][1]
+                  << std::setw(9) << (int64_t(times[i][0]) - times[i][1]) * 100 / (times[i][0] + 1) << "%" << std::endl;
+    }
+}
+
+void smp_scaling_bench(int depth, int positions) {
+    // Time to depth from 1 to MAX_THREADS threads, relative to a single thread
+    int tmp_threads = num_threads;
+    int tmp_depth = think_depth_limit;
+    int tmp_myremain = myremain;
+    int single_time = 1;
+
+    std::cout << "Depth " << depth << ", " << positions << " positions" << std::endl;
+    std::cout << "Threads      Time        Nodes       NPS  Speedup" << std::endl;
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        uint64_t nodes;
+        int time_taken = smp_bench_run(threads, share_history, depth, positions, &nodes);
+        if (threads == 1) {
+            single_time = std::max(1, time_taken);
+        }
+        std::cout << std::setw(7) << threads
+                  << std::setw(10) << time_taken
+                  << std::setw(13) << nodes
+                  << std::setw(10) << 1000 * nodes / (time_taken + 1)
+                  << std::setw(9) << std::fixed << std::setprecision(2) << double(single_time) / std::max(1, time_taken)
+                  << std::endl;
+    }
+
+    think_depth_limit = tmp_depth;
+    myremain = tmp_myremain;
+    reset_threads(tmp_threads);
+    clear_threads();
+    clear_tt();
+}
@@ -36,7 +36,32 @@ inline int lmr(bool is_pv, int depth, int num_moves) {
     return reductions[is_pv][std::min(depth, 63)][std::min(num_moves, 63)];
 }
 
-extern struct timeval curr_time, start_ts;
+enum SkipPattern {
+    SKIP_NONE = 0, // Every thread searches every depth
+    SKIP_ODD,      // Odd numbered threads search one depth ahead
+    SKIP_TABLE     // Helpers skip depths following a fixed table
+};
+
+extern int smp_skip;
+extern int multi_pv;
+
+typedef struct SearchLimits {
+    int      time[2];    // wtime and btime
+    int      inc[2];     // winc and binc
+    int      movestogo;
+    int      movetime;
+    int      depth;      // 0 when not given
+    int      mate;       // In moves
+    uint64_t nodes;      // Checked once per timer_count batch
+    bool     use_clock;
+    bool     infinite;
+    bool     ponder;
+    std::vector<Move> searchmoves;
+} SearchLimits;
+
+extern SearchLimits limits;
+
+extern struct timeval curr_time, start_ts, go_ts;
 
 extern int timer_count,
            myremain,
@@ -46,8 +71,6 @@ extern int timer_count,
 extern bool is_movetime;
 
 extern volatile bool is_timeout,
-                     quit_application,
-                     is_searching,
                      is_pondering;
 
 inline int time_passed() {
@@ -58,69 +81,20 @@ inline int bench_time(struct timeval s, struct timeval e) {
     return (((e.tv_sec - s.tv_sec) * 1000000) + (e.tv_usec - s.tv_usec)) / 1000;
 }
 
-inline void init_time(Position *p, std::vector<std::string> word_list) {
-    is_pondering = false;
-    is_movetime = false;
-    timer_count = 1024;
-    is_timeout = false;
-
-    if (word_list.size() <= 1) {
-        myremain = 10000;
-        total_remaining = 10000;
-        return;
-    }
-
-    think_depth_limit = MAX_PLY;
-
-    if (word_list[1] == "movetime") {
-        myremain = stoi(word_list[2]) * 99 / 100;
-        total_remaining = myremain;
-        is_movetime = true;
-    } else if (word_list[1] == "infinite") {
-        myremain = 3600000;
-        total_remaining = myremain;
-    } else if (word_list[1] == "depth") {
-        myremain = 3600000;
-        total_remaining = myremain;
-        think_depth_limit = stoi(word_list[2]);
-    } else if (word_list.size() > 1) {
-        int moves_to_go = 0;
-        int black_remaining = 0;
-        int white_remaining = 0;
-        int black_increment = 0;
-        int white_increment = 0;
-
-        for (unsigned i = 1; i < word_list.size(); ++i) {
-            if (word_list[i] == "wtime") {
-                white_remaining = stoi(word_list[i + 1]);
-            } else if (word_list[i] == "btime") {
-                black_remaining = stoi(word_list[i + 1]);
-            } else if (word_list[i] == "winc") {
-                white_increment = stoi(word_list[i + 1]);
-            } else if (word_list[i] == "binc") {
-                black_increment = stoi(word_list[i + 1]);
-            } else if (word_list[i] == "movestogo") {
-                moves_to_go = stoi(word_list[i + 1]);
-            } else if (word_list[i] == "ponder") {
-                is_pondering = true;
-            }
-        }
-
-        TTime t = get_myremain(
-            p->color == white ? white_increment : black_increment,
-            p->color == white ? white_remaining : black_remaining,
-            moves_to_go,
-            p->my_thread->root_ply
-        );
-        myremain = t.optimum_time;
-        total_remaining = t.maximum_time;
-    }
+inline int time_passed_us(struct timeval s, struct timeval e) {
+    return ((e.tv_sec - s.tv_sec) * 1000000) + (e.tv_usec - s.tv_usec);
 }
 
+void init_time(Position *p, std::vector<std::string> word_list);
+
 int alpha_beta_quiescence(Position *p, Metadata *md, int alpha, int beta, int depth, bool in_check);
+void thread_think(SearchThread *my_thread, bool in_check);
 void think(Position *p, std::vector<std::string> word_list);
 void print_pv();
-void bench();
+uint64_t bench(int depth = 13, int threads = 0, int hash = 0, std::string fen_file = "", std::string out_file = "");
+void bench_large_pages();
+void smp_bench(int depth, int positions);
+void smp_scaling_bench(int depth, int positions);
 
 // Positions taken from Ethereal
 const std::string benchmarks[36] = {
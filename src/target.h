@@ -23,6 +23,11 @@
 
 Bitboard pinned_piece_squares(Position *p, Color color);
 
+// Squares a piece on sq can move to without exposing its king, all of them unless pinned
+inline Bitboard pin_mask(Position *p, Color color, Square sq) {
+    return (p->info->pinned[color] & bfi[sq]) ? FROMTO_MASK[p->king_index[color]][sq] : ~0ULL;
+}
+
 Bitboard generate_rook_targets(Bitboard board, Square index);
 Bitboard generate_bishop_targets(Bitboard board, Square index);
 Bitboard generate_knight_targets(Square index);
@@ -16,7 +16,12 @@
     along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "bitboard.h"
 #include "move.h"
@@ -28,6 +33,8 @@
 #include "see.h"
 #include "target.h"
 #include "test.h"
+#include "thread.h"
+#include "tt.h"
 
 std::string fen[7] = {
     "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
@@ -84,9 +91,6 @@ void perft_test(){
     // Positions taken from https://chessprogramming.wikispaces.com/Perft+Results
     printf("\nStarted testing !\n\n");
 
-    init();
-    init_magic();
-
     int total_result = 597452135;
 
     int results[] = {119060324, 193690690, 11030083, 15833292, 89941194, 164075551, 3821001};
@@ -99,7 +103,7 @@ void perft_test(){
     gettimeofday(&tv3, NULL);
 
     for (int i = 0; i < 7; i++){
-        Position *p = import_fen(fen[i].c_str(), 0);
+        import_fen(fen[i].c_str(), 0);
 
         int t_depth = depths[i];
 
@@ -107,7 +111,7 @@ void perft_test(){
         
         gettimeofday(&tv1, NULL);
         
-        results_perft[i] = Perft(t_depth, p, true, is_checked(p));
+        results_perft[i] = parallel_perft(t_depth, num_threads, 64, false);
         nodes_total += results_perft[i];
         
         gettimeofday(&tv2, NULL);
@@ -121,6 +125,12 @@ void perft_test(){
         (double) (tv2.tv_sec - tv1.tv_sec));
     }
 
+    // The hash table and the threads share no code with the plain perft, so
+    // one position is also counted without them
+    const int unhashed = 6;
+    Position *p = import_fen(fen[unhashed].c_str(), 0);
+    uint64_t unhashed_nodes = Perft(depths[unhashed], p, false, is_checked(p));
+
     gettimeofday(&tv4, NULL);
     std::cout << "\n\n\n=@==================@=\n";
     for (int i = 0; i < 7; i++){
@@ -133,6 +143,12 @@ void perft_test(){
         }
     }
 
+    if (unhashed_nodes != uint64_t(results[unhashed])){
+        std::cout << "!!! Unhashed perft in position " << unhashed+1 << " generated " << unhashed_nodes << " nodes, expected " << results[unhashed] << " !" << std::endl;
+    }else{
+        std::cout << "@Unhashed perft in position " << unhashed+1 << " generated " << unhashed_nodes << " nodes perfectly !" << std::endl;
+    }
+
     if (nodes_total > total_result){
         std::cout << "!!! we generated: " << nodes_total - total_result << " more nodes " << std::endl;
     } else if (nodes_total < total_result){
@@ -167,8 +183,8 @@ void undo_test(Position *p, Move move) {
     for (int i = white_occupy; i <= black_king; ++i) {
         assert(p->bbs[i] == tmp.bbs[i]);
     }
-    assert(p->score.midgame == tmp.score.midgame);
-    assert(p->score.endgame == tmp.score.endgame);
+    assert(mg_value(p->score) == mg_value(tmp.score));
+    assert(eg_value(p->score) == eg_value(tmp.score));
     assert(p->king_index[white] == tmp.king_index[white]);
     assert(p->king_index[black] == tmp.king_index[black]);
     assert(p->board == tmp.board);
@@ -198,6 +214,9 @@ uint64_t fastPerft(int depth, Position *p, bool root, bool in_check) {
     MoveGen movegen = new_movegen(p, md, no_move, NORMAL_SEARCH, 0, in_check);
     Move move;
     while ((move = next_move(&movegen, md, 0)) != no_move) {
+        if (!is_legal(p, move)) {
+            continue;
+        }
         if (root && depth == 1) {
             move_nodes = 1;
             ++nodes;
@@ -206,13 +225,7 @@ uint64_t fastPerft(int depth, Position *p, bool root, bool in_check) {
             bool checks = gives_check(p, move);
             make_move(p, move);
             if (is_leaf) {
-                MoveGen movegen_leaf = new_movegen(p, md, no_move, NORMAL_SEARCH, 0, checks);
-                if (checks) {
-                    generate_evasions(&movegen_leaf, p);
-                } else {
-                    generate_moves<ALL>(&movegen_leaf, p);
-                }
-                move_nodes = movegen_leaf.tail;
+                move_nodes = count_legal_moves(p);
             } else {
                 move_nodes = fastPerft(depth - 1, p, false, checks);
             }
@@ -227,6 +240,165 @@ uint64_t fastPerft(int depth, Position *p, bool root, bool in_check) {
     return nodes;
 }
 
+// Perft table entries hold the node count and depth in data, key is the hash
+// xored with data so that torn writes from other threads are never trusted
+typedef struct PerftEntry {
+    uint64_t key;
+    uint64_t data;
+} PerftEntry;
+
+typedef struct PerftTable {
+    PerftEntry *entries;
+    uint64_t mask;
+} PerftTable;
+
+bool probe_perft(PerftTable *perft_table, uint64_t hash, int depth, uint64_t *nodes) {
+    PerftEntry *entry = &perft_table->entries[hash & perft_table->mask];
+    uint64_t key = __atomic_load_n(&entry->key, __ATOMIC_RELAXED);
+    uint64_t data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+    if ((key ^ data) != hash || int(data & 0xFF) != depth) {
+        return false;
+    }
+    *nodes = data >> 8;
+    return true;
+}
+
+void store_perft(PerftTable *perft_table, uint64_t hash, int depth, uint64_t nodes) {
+    PerftEntry *entry = &perft_table->entries[hash & perft_table->mask];
+    uint64_t data = (nodes << 8) | uint64_t(depth);
+    __atomic_store_n(&entry->key, hash ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
+
+void generate_perft_moves(MoveGen *movegen, Position *p, bool in_check) {
+    if (in_check) {
+        generate_evasions(movegen, p);
+    } else {
+        generate_moves<ALL>(movegen, p);
+    }
+}
+
+uint64_t hashed_perft(int depth, Position *p, bool in_check, PerftTable *perft_table) {
+    if (depth <= 0) {
+        return 1;
+    }
+    if (depth == 1) {
+        return count_legal_moves(p);
+    }
+    uint64_t nodes = 0;
+    uint64_t hash = p->info->hash;
+    if (depth >= 3 && probe_perft(perft_table, hash, depth, &nodes)) {
+        return nodes;
+    }
+
+    Metadata *md = &p->my_thread->metadatas[2];
+    MoveGen movegen = new_movegen(p, md, no_move, NORMAL_SEARCH, 0, in_check);
+    generate_perft_moves(&movegen, p, in_check);
+
+    for (int i = movegen.head; i < movegen.tail; ++i) {
+        Move move = movegen.moves[i];
+        if (!is_legal(p, move)) {
+            continue;
+        }
+        bool checks = gives_check(p, move);
+        make_move(p, move);
+        nodes += hashed_perft(depth - 1, p, checks, perft_table);
+        undo_move(p, move);
+    }
+
+    if (depth >= 3) {
+        store_perft(perft_table, hash, depth, nodes);
+    }
+    return nodes;
+}
+
+void perft_worker(SearchThread *t, int depth, std::vector<Move> *root_moves, std::vector<uint64_t> *results,
+                  std::atomic<int> *next, PerftTable *perft_table) {
+    // Root moves are handed out one at a time, so threads that finish early take the remaining ones
+    Position *p = &t->position;
+    int i;
+    while ((i = next->fetch_add(1)) < int(root_moves->size())) {
+        Move move = (*root_moves)[i];
+        if (depth <= 1) {
+            (*results)[i] = 1;
+            continue;
+        }
+        bool checks = gives_check(p, move);
+        make_move(p, move);
+        (*results)[i] = hashed_perft(depth - 1, p, checks, perft_table);
+        undo_move(p, move);
+    }
+}
+
+uint64_t parallel_perft(int depth, int threads, int hash_mb, bool divide) {
+    // Searches the main thread's position with the search threads' positions and metadata
+    if (depth <= 0) {
+        // Only the root itself, there are no moves to hand out
+        if (divide) {
+            std::cout << "\nNodes : 1" << std::endl;
+        }
+        return 1;
+    }
+    int tmp_threads = num_threads;
+    threads = std::min(std::max(threads, 1), MAX_THREADS);
+    if (threads != num_threads) {
+        reset_threads(threads);
+    }
+    get_ready();
+
+    PerftTable perft_table;
+    uint64_t entries = uint64_t(hash_mb) * 1024 * 1024 / sizeof(PerftEntry);
+    while (more_than_one(entries)) {
+        entries &= entries - 1;
+    }
+    perft_table.entries = new PerftEntry[entries]();
+    perft_table.mask = entries - 1;
+
+    Position *p = &main_thread.position;
+    bool in_check = is_checked(p);
+    std::vector<Move> root_moves;
+    MoveGen movegen = new_movegen(p, &main_thread.metadatas[2], no_move, NORMAL_SEARCH, 0, in_check);
+    generate_perft_moves(&movegen, p, in_check);
+    for (int i = movegen.head; i < movegen.tail; ++i) {
+        if (is_legal(p, movegen.moves[i])) {
+            root_moves.push_back(movegen.moves[i]);
+        }
+    }
+
+    std::vector<uint64_t> results(root_moves.size(), 0);
+    std::atomic<int> next(0);
+
+    struct timeval start, end;
+    gettimeofday(&start, nullptr);
+
+    run_on_threads(threads, [&](int index) {
+        perft_worker(get_thread(index), depth, &root_moves, &results, &next, &perft_table);
+    });
+
+    gettimeofday(&end, nullptr);
+    int time_taken = bench_time(start, end);
+
+    uint64_t nodes = 0;
+    for (size_t i = 0; i < root_moves.size(); ++i) {
+        nodes += results[i];
+        if (divide) {
+            std::cout << move_to_str(p, root_moves[i]) << ": " << results[i] << std::endl;
+        }
+    }
+    if (divide) {
+        std::cout << "\nNodes : " << nodes << std::endl;
+        std::cout << "Time  : " << time_taken << " ms" << std::endl;
+        std::cout << "NPS   : " << nodes * 1000 / (time_taken + 1) << std::endl;
+    }
+
+    delete[] perft_table.entries;
+    if (threads != tmp_threads) {
+        reset_threads(tmp_threads);
+        get_ready();
+    }
+    return nodes;
+}
+
 void pseudolegal_test(Position *p) {
     // Generate all moves and test pseudo legal
     for (Square a = A1; a <= H8; ++a) {
@@ -237,7 +409,7 @@ void pseudolegal_test(Position *p) {
                 generate_moves<ALL>(&movegen, p);
                 bool found = false;
                 for (uint8_t move_idx = movegen.head; move_idx < movegen.tail; ++move_idx) {
-                    if (movegen.moves[move_idx].move == gen_move) {
+                    if (movegen.moves[move_idx] == gen_move) {
                         found = true;
                         break;
                     }
@@ -279,3 +451,106 @@ uint64_t Perft(int depth, Position *p, bool root, bool in_check) {
 
     return nodes;
 }
+
+// Keys used by tt_stress_test, they all land in the first few buckets
+const int stress_keys = 64;
+const int stress_buckets = 4;
+
+uint64_t stress_hash(int key) {
+    return (uint64_t(key + 1) << 48) | uint64_t(key % stress_buckets);
+}
+
+TTEntry stress_entry(int key) {
+    TTEntry tte;
+    tte.move = Move(0x1000 + key * 13);
+    tte.score = int16_t(key * 97 - 3000);
+    tte.static_eval = int16_t(-key * 31);
+    tte.ageflag = (table.generation << 2) | FLAG_EXACT;
+    tte.depth = int8_t(key % 40 + 1);
+    return tte;
+}
+
+void stress_worker(int index, int iterations, uint64_t *results) {
+    uint64_t seed = 0x9E3779B97F4A7C15ULL * (index + 1);
+    uint64_t reads = 0, detected = 0, undetected = 0;
+    TTStats stats;
+    std::memset(&stats, 0, sizeof(TTStats));
+
+    for (int i = 0; i < iterations; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        int key = int(seed % stress_keys);
+        uint64_t hash = stress_hash(key);
+
+        if (seed & 0x100) {
+            TTEntry tte = stress_entry(key);
+            TTEntry probed;
+            bool tt_hit;
+            uint64_t *slot = get_tte(&stats, hash, tte.depth, probed, tt_hit);
+            set_tte(&stats, hash, slot, tte.move, tte.depth, tte.score, tte.static_eval, FLAG_EXACT);
+            continue;
+        }
+
+        // Inspect the raw bucket, every non empty slot has to either fail the
+        // key check or hold exactly what was written for its key
+        Bucket *bucket = &table.tt[hash & table.bucket_mask];
+        for (int j = 0; j < bucket_size; ++j) {
+            uint64_t data = load_data(bucket, j);
+            uint16_t h = tte_hash(load_key(bucket, j), data);
+            if (!data) {
+                continue;
+            }
+            ++reads;
+
+            int owner = int(h) - 1;
+            if (owner < 0 || owner >= stress_keys || (stress_hash(owner) & table.bucket_mask) != (hash & table.bucket_mask)) {
+                ++detected;
+                continue;
+            }
+            TTEntry expected = stress_entry(owner);
+            if (data != pack_tte(&expected)) {
+                ++undetected;
+            }
+        }
+    }
+
+    results[0] = reads;
+    results[1] = detected;
+    results[2] = undetected;
+}
+
+void tt_stress_test(int thread_count) {
+    const int iterations = 200000;
+    thread_count = std::min(std::max(thread_count, 1), MAX_THREADS);
+    clear_tt();
+
+    struct timeval start, end;
+    gettimeofday(&start, nullptr);
+
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> results(thread_count * 3);
+    for (int i = 0; i < thread_count; ++i) {
+        threads.emplace_back(stress_worker, i, iterations, &results[i * 3]);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    gettimeofday(&end, nullptr);
+
+    uint64_t totals[3] = {0, 0, 0};
+    for (int i = 0; i < thread_count; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            totals[j] += results[i * 3 + j];
+        }
+    }
+    clear_tt();
+
+    std::cout << "Threads    : " << thread_count << std::endl;
+    std::cout << "Time       : " << bench_time(start, end) << std::endl;
+    std::cout << "Reads      : " << totals[0] << std::endl;
+    std::cout << "Detected   : " << totals[1] << std::endl;
+    std::cout << "Undetected : " << totals[2] << std::endl;
+}
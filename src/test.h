@@ -24,9 +24,11 @@
 #include "const.h"
 
 uint64_t Perft(int index, Position* p, bool root, bool in_check);
+uint64_t parallel_perft(int depth, int threads, int hash_mb, bool divide);
 
 void see_test();
 void perft_test();
 void undo_test(Position *p, Move move);
+void tt_stress_test(int thread_count);
 
 #endif
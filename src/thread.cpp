@@ -16,12 +16,239 @@
     along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <iostream>
+#include <new>
+#include <sys/time.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "const.h"
 #include "data.h"
+#include "move.h"
+#include "position.h"
+#include "search.h"
 #include "thread.h"
 
+std::vector<std::string> think_word_list;
+
+// Set by launch_search and cleared right before the best move is printed.
+// Until then the UCI thread leaves the position, threads and tables alone.
+std::atomic<bool> search_active(false);
+
+int pawn_hash_size = 1; // MB per thread
+bool share_history = false;
+int shared_history[2][64][64];
+
+// In deterministic mode the threads take turns, each searching turn_quantum
+// nodes before handing over, so the shared tables see the same interleaving
+// on every run
+bool deterministic = false;
+std::mutex turn_mutex;
+std::condition_variable turn_condition;
+int turn = 0;
+
+void pin_thread(int thread_id) {
+#ifdef __linux__
+    // A single threaded engine is left alone so that several engines can share a machine
+    if (num_threads <= 1) {
+        return;
+    }
+
+    // Pick the nth cpu out of the ones the process is allowed to run on
+    cpu_set_t allowed, target;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+        return;
+    }
+
+    int cpu_count = CPU_COUNT(&allowed);
+    int n = thread_id % cpu_count;
+    CPU_ZERO(&target);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            CPU_SET(cpu, &target);
+            break;
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &target);
+#else
+    (void) thread_id;
+#endif
+}
+
+void idle_loop(SearchThread *t) {
+    pin_thread(t->thread_id);
+    init_thread(t);
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(t->mutex);
+        t->searching = false;
+        t->sleep_condition.notify_all();
+
+        while (!t->searching && !t->exiting) {
+            t->sleep_condition.wait(lock);
+        }
+
+        if (t->exiting) {
+            return;
+        }
+        lock.unlock();
+
+        if (t->job) {
+            t->job();
+            t->job = nullptr;
+        } else if (t->thread_id == 0) {
+            think(&t->position, think_word_list);
+        } else {
+            if (deterministic) {
+                wait_turn(t);
+            }
+            thread_think(t, is_checked(&t->position));
+            if (deterministic) {
+                leave_turns(t);
+            }
+        }
+    }
+}
+
+int next_turn(int thread_id) {
+    for (int i = 1; i <= num_threads; ++i) {
+        int next = (thread_id + i) % num_threads;
+        if (get_thread(next)->scheduled) {
+            return next;
+        }
+    }
+    return -1;
+}
+
+void start_turns() {
+    std::unique_lock<std::mutex> lock(turn_mutex);
+    for (int i = 0; i < num_threads; ++i) {
+        SearchThread *t = get_thread(i);
+        t->scheduled = true;
+        t->turn_count = turn_quantum;
+    }
+    turn = 0;
+}
+
+void wait_turn(SearchThread *t) {
+    std::unique_lock<std::mutex> lock(turn_mutex);
+    // A stopped search releases everyone, the results no longer change
+    while (turn != t->thread_id && !is_timeout) {
+        turn_condition.wait_for(lock, std::chrono::milliseconds(1));
+    }
+}
+
+void pass_turn(SearchThread *t) {
+    {
+        std::unique_lock<std::mutex> lock(turn_mutex);
+        turn = next_turn(t->thread_id);
+        turn_condition.notify_all();
+    }
+    wait_turn(t);
+}
+
+void leave_turns(SearchThread *t) {
+    std::unique_lock<std::mutex> lock(turn_mutex);
+    t->scheduled = false;
+    if (turn == t->thread_id) {
+        turn = next_turn(t->thread_id);
+        turn_condition.notify_all();
+    }
+}
+
+void wake_thread(SearchThread *t) {
+    std::unique_lock<std::mutex> lock(t->mutex);
+    t->searching = true;
+    t->sleep_condition.notify_all();
+}
+
+void wait_thread(SearchThread *t) {
+    std::unique_lock<std::mutex> lock(t->mutex);
+    while (t->searching) {
+        t->sleep_condition.wait(lock);
+    }
+}
+
+void run_job(SearchThread *t, std::function<void()> job) {
+    wait_thread(t);
+    std::unique_lock<std::mutex> lock(t->mutex);
+    t->job = job;
+    t->searching = true;
+    t->sleep_condition.notify_all();
+}
+
+void run_on_threads(int count, std::function<void(int)> job) {
+    // Splits work over the first count workers, which also first touch the
+    // memory they write
+    count = std::max(1, std::min(count, num_threads));
+    for (int i = 0; i < count; ++i) {
+        run_job(get_thread(i), [job, i]() { job(i); });
+    }
+    for (int i = 0; i < count; ++i) {
+        wait_thread(get_thread(i));
+    }
+}
+
+void start_threads() {
+    for (int i = 0; i < num_threads; ++i) {
+        SearchThread *t = get_thread(i);
+        t->searching = true;
+        t->exiting = false;
+        t->native_thread = std::thread(idle_loop, t);
+    }
+
+    // Make sure every worker is parked before returning
+    for (int i = 0; i < num_threads; ++i) {
+        wait_thread(get_thread(i));
+    }
+}
+
+void destroy_threads() {
+    for (int i = 0; i < num_threads; ++i) {
+        SearchThread *t = get_thread(i);
+        if (!t->native_thread.joinable()) {
+            continue;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(t->mutex);
+            t->exiting = true;
+            t->sleep_condition.notify_all();
+        }
+        t->native_thread.join();
+    }
+}
+
+bool launch_search(std::vector<std::string> word_list) {
+    if (search_active) {
+        return false;
+    }
+
+    // The previous search might still be going back to sleep after its best move
+    wait_thread(&main_thread);
+
+    // Reset here rather than in the search thread, so a stop or ponderhit
+    // that arrives before the search starts is not lost
+    search_active = true;
+    is_timeout = false;
+    is_pondering = std::find(word_list.begin(), word_list.end(), "ponder") != word_list.end();
+    gettimeofday(&go_ts, nullptr);
+    think_word_list = word_list;
+    wake_thread(&main_thread);
+    return true;
+}
+
+void wait_search() {
+    wait_thread(&main_thread);
+}
+
 void get_ready() {
     main_thread.root_ply = main_thread.search_ply;
 
@@ -54,83 +281,154 @@ void get_ready() {
             md->killers[1] = no_move;
             md->pv[0] = no_move;
             md->excluded_move = no_move;
-            md->counter_move_history = t->counter_move_history[no_piece][0];
+            md->counter_move_history = cmh_table(t, no_piece, 0);
         }
     }
 }
 
-void delete_histories(SearchThread *t) {
-    for (int j = 0; j < NUM_PIECE; ++j) {
-        for (int k = 0; k < 64; ++k) {
-            for (int l = 0; l < NUM_PIECE; ++l) {
-                delete[] t->counter_move_history[j][k][l];
-            }
-            delete[] t->counter_move_history[j][k];
-        }
+void *alloc_aligned(size_t size, size_t alignment) {
+    void *mem = nullptr;
+#ifdef _WIN32
+    mem = _aligned_malloc(size, alignment);
+#else
+    if (posix_memalign(&mem, alignment, size)) {
+        mem = nullptr;
+    }
+#endif
+    if (!mem) {
+        std::cout << "info string Failed to allocate " << size << " bytes for a search thread" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+
+void free_aligned(void *mem) {
+#ifdef _WIN32
+    _aligned_free(mem);
+#else
+    free(mem);
+#endif
+}
+
+void alloc_pawntt(SearchThread *t) {
+    // Largest power of 2 number of entries that fits in the configured size
+    uint64_t entries = uint64_t(pawn_hash_size) * 1024 * 1024 / sizeof(PawnTTEntry);
+    while (more_than_one(entries)) {
+        entries &= entries - 1;
     }
+    t->pawntt = new PawnTTEntry[entries]();
+    t->pawntt_mask = entries - 1;
+}
+
+void free_pawntt(SearchThread *t) {
+    delete[] t->pawntt;
+    t->pawntt = nullptr;
 }
 
-void init_histories(SearchThread *t) {
+void clear_thread(SearchThread *t) {
+    // Clear history
+    std::memset(&t->own_history, 0, sizeof(t->own_history));
+    std::memset(&t->tt_stats, 0, sizeof(t->tt_stats));
+    std::memset(&t->evalcache, 0, sizeof(t->evalcache));
+
+    // Tables following a null move start at -1, which is all bits set
+    std::memset(t->counter_move_history, 0, cmh_size * sizeof(int16_t));
+    std::memset(cmh_table(t, no_piece, 0), 0xFF, 64 * cmh_table_size * sizeof(int16_t));
+
+    // Clear counter moves
     for (int j = 0; j < NUM_PIECE; ++j) {
         for (int k = 0; k < 64; ++k) {
-            t->counter_move_history[j][k] = new int*[NUM_PIECE];
-            for (int l = 0; l < NUM_PIECE; ++l) {
-                t->counter_move_history[j][k][l] = new int[64];
-            }
+            t->counter_moves[j][k] = no_move;
         }
     }
 }
 
 void clear_threads() {
+    std::memset(shared_history, 0, sizeof(shared_history));
     for (int i = 0; i < num_threads; ++i) {
-        SearchThread *search_thread = get_thread(i);
-
-        // Clear history
-        std::memset(&search_thread->history, 0, sizeof(search_thread->history));
-
-        init_histories(search_thread);
-        for (int j = 0; j < NUM_PIECE; ++j) {
-            for (int k = 0; k < 64; ++k) {
-                for (int l = 0; l < NUM_PIECE; ++l) {
-                    for (int m = 0; m < 64; ++m) {
-                        search_thread->counter_move_history[j][k][l][m] = j == no_piece ? -1 : 0;
-                    }
-                }
-            }
-        }
-
-        // Clear counter moves
-        for (int j = 0; j < NUM_PIECE; ++j) {
-            for (int k = 0; k < 64; ++k) {
-                search_thread->counter_moves[j][k] = no_move;
-            }
-        }
+        clear_thread(get_thread(i));
     }
 }
 
-void reset_threads(int thread_num) {
+void set_shared_history(bool shared) {
+    share_history = shared;
     for (int i = 0; i < num_threads; ++i) {
-        // Only delete histories of existing threads
-        delete_histories(get_thread(i));
+        SearchThread *t = get_thread(i);
+        t->history = shared ? shared_history : t->own_history;
     }
+}
 
-    num_threads = thread_num;
-    delete[] search_threads;
-    search_threads = new SearchThread[num_threads - 1];
+void init_thread(SearchThread *t) {
+    // Runs on the worker itself, so the pages are first touched on the node
+    // it is pinned to. The main thread's infos hold the game and are kept.
+    if (t->thread_id != 0) {
+        std::memset(t->infos, 0, sizeof(t->infos));
+        std::memset(t->metadatas, 0, sizeof(t->metadatas));
+    }
+    alloc_pawntt(t);
+    t->counter_move_history = (int16_t*) alloc_aligned(cmh_size * sizeof(int16_t), 64);
+    clear_thread(t);
+}
 
-    for (int i = 1; i < thread_num; ++i) {
+void free_thread(SearchThread *t) {
+    free_pawntt(t);
+    free_aligned(t->counter_move_history);
+    t->counter_move_history = nullptr;
+}
+
+SearchThread *new_search_thread() {
+    // Default initialization leaves the large arrays untouched until the worker clears them
+    return new (alloc_aligned(sizeof(SearchThread), alignof(SearchThread))) SearchThread;
+}
+
+void delete_search_thread(SearchThread *t) {
+    t->~SearchThread();
+    free_aligned(t);
+}
+
+void create_threads() {
+    search_threads = new SearchThread*[num_threads - 1];
+    for (int i = 0; i < num_threads; ++i) {
+        if (i > 0) {
+            search_threads[i - 1] = new_search_thread();
+        }
         get_thread(i)->thread_id = i;
     }
-    clear_threads();
+    set_shared_history(share_history);
+    start_threads();
+}
+
+void delete_threads() {
+    destroy_threads();
+    for (int i = 0; i < num_threads; ++i) {
+        free_thread(get_thread(i));
+        if (i > 0) {
+            delete_search_thread(get_thread(i));
+        }
+    }
+    delete[] search_threads;
+    search_threads = nullptr;
+}
+
+void reset_pawntt(int megabytes) {
+    // The workers allocate their own pawn hash when they start
+    delete_threads();
+    pawn_hash_size = megabytes;
+    create_threads();
+    get_ready();
+}
+
+void reset_threads(int thread_num) {
+    delete_threads();
+    num_threads = thread_num;
+    create_threads();
     get_ready();
 }
 
 void init_threads() {
-    search_threads = new SearchThread[num_threads - 1];
+    create_threads();
 
-    for (int i = 0; i < num_threads; ++i) {
-        get_thread(i)->thread_id = i;
-    }
-    clear_threads();
+    // Workers have to be joined before the static thread objects are destroyed
+    std::atexit(destroy_threads);
 }
 
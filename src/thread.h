@@ -19,10 +19,39 @@
 #ifndef THREAD_H
 #define THREAD_H
 
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "const.h"
+
 void get_ready();
 void clear_threads();
+void init_thread(SearchThread *t);
 void init_threads();
 void reset_threads(int thread_num);
+void destroy_threads();
+void reset_pawntt(int megabytes);
+void set_shared_history(bool shared);
+
+extern bool share_history;
+extern bool deterministic;
+extern std::atomic<bool> search_active;
+
+const int turn_quantum = 1024; // Nodes a thread searches before the next one takes over
+
+void start_turns();
+void wait_turn(SearchThread *t);
+void pass_turn(SearchThread *t);
+void leave_turns(SearchThread *t);
+
+void wake_thread(SearchThread *t);
+void wait_thread(SearchThread *t);
+void run_job(SearchThread *t, std::function<void()> job);
+void run_on_threads(int count, std::function<void(int)> job);
+bool launch_search(std::vector<std::string> word_list);
+void wait_search();
 
 #endif
 
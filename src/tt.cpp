@@ -16,36 +16,309 @@
     along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sys/time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "tt.h"
 #include "const.h"
+#include "thread.h"
 
 Table table;
+bool large_pages = true;
+std::string hash_file = "";
+
+void fill_header(TableHeader *header) {
+    std::memset(header, 0, sizeof(TableHeader));
+    std::memcpy(header->magic, tt_file_magic, sizeof(tt_file_magic));
+    header->version = tt_file_version;
+    header->bucket_bytes = sizeof(Bucket);
+    header->bucket_entries = bucket_size;
+    header->generation = table.generation;
+    header->tt_size = table.tt_size;
+}
+
+bool valid_header(TableHeader *header) {
+    return std::memcmp(header->magic, tt_file_magic, sizeof(tt_file_magic)) == 0 &&
+           header->version == tt_file_version &&
+           header->bucket_bytes == sizeof(Bucket) &&
+           header->bucket_entries == bucket_size &&
+           header->generation < 64 &&
+           header->tt_size >= one_mb && header->tt_size <= max_tt_mb * one_mb &&
+           (header->tt_size & (header->tt_size - 1)) == 0;
+}
+
+void clear_tt_stats() {
+    for (int i = 0; i < num_threads; ++i) {
+        std::memset(&get_thread(i)->tt_stats, 0, sizeof(TTStats));
+    }
+}
+
+void clear_fresh_writes() {
+    for (int i = 0; i < num_threads; ++i) {
+        get_thread(i)->tt_stats.fresh_writes = 0;
+    }
+}
+
+void restore_occupancy() {
+    // A table that was filled elsewhere has no write counts, estimate them
+    clear_tt_stats();
+    main_thread.tt_stats.fresh_writes = uint64_t(hashfull_sampled()) * (table.bucket_mask + 1) * bucket_size / 1000;
+}
+
+void set_generation(uint8_t generation) {
+    table.generation = generation;
+    if (table.memory == MEMORY_FILE) {
+        table.file_header->generation = generation;
+    }
+}
+
+#ifndef _WIN32
+bool map_file(uint64_t size, bool &warm) {
+    // Maps the HashFile and reports whether it already held a table of this size
+    int fd = open(hash_file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    uint64_t file_size = tt_file_header_size + size;
+    struct stat st;
+    TableHeader header;
+    warm = fstat(fd, &st) == 0 && uint64_t(st.st_size) == file_size &&
+           pread(fd, &header, sizeof(TableHeader), 0) == sizeof(TableHeader) &&
+           valid_header(&header) && header.tt_size == size;
+
+    if (!warm && ftruncate(fd, off_t(file_size)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file open
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+
+    table.file_header = (TableHeader*) mem;
+    table.tt = (Bucket*) ((char*) mem + tt_file_header_size);
+    table.memory = MEMORY_FILE;
+    return true;
+}
+#endif
+
+#ifdef __linux__
+void *mmap_huge(uint64_t size, int page_flag) {
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | page_flag, -1, 0);
+    return mem == MAP_FAILED ? nullptr : mem;
+}
+
+bool interleave_nodes(void *mem, uint64_t size) {
+    // Spread the pages of the table round robin over every NUMA node so that
+    // probes from all threads don't go through a single memory controller.
+    // This is a no-op on single node machines. The start has to be page
+    // aligned, kernels without NUMA support fail with ENOSYS.
+    const unsigned long mpol_interleave = 3;
+    unsigned long nodemask[16];
+    std::memset(nodemask, 0xFF, sizeof(nodemask));
+    return syscall(SYS_mbind, mem, size, mpol_interleave, nodemask, sizeof(nodemask) * 8, 0) == 0 || errno == ENOSYS;
+}
+#endif
+
+bool alloc_table(uint64_t size) {
+    // Returns true when the memory already holds a table, from the HashFile
+    table.tt = nullptr;
+    table.file_header = nullptr;
+    table.memory = MEMORY_ALIGNED;
+
+    if (!hash_file.empty()) {
+        bool warm = false;
+#ifndef _WIN32
+        if (map_file(size, warm)) {
+            std::cout << "info string Mapped " << hash_file << (warm ? ", continuing with its table" : ", starting with an empty table") << std::endl;
+            return warm;
+        }
+#endif
+        std::cout << "info string Could not map " << hash_file << ", using regular memory" << std::endl;
+    }
+
+#if defined(__linux__) && defined(MAP_HUGE_1GB) && defined(MAP_HUGE_2MB)
+    // Reserved huge pages (vm.nr_hugepages) are used when available, otherwise
+    // fall back to regular memory below
+    if (large_pages && size % one_gb == 0) {
+        table.tt = (Bucket*) mmap_huge(size, MAP_HUGE_1GB);
+        table.memory = MEMORY_HUGETLB_1GB;
+    }
+    if (large_pages && !table.tt && size % huge_page_size == 0) {
+        table.tt = (Bucket*) mmap_huge(size, MAP_HUGE_2MB);
+        table.memory = MEMORY_HUGETLB_2MB;
+    }
+#endif
+
+    if (!table.tt) {
+        table.memory = MEMORY_ALIGNED;
+        // Aligning to the huge page size lets the kernel back the table with
+        // transparent huge pages, and mbind needs a page aligned start anyway
+        uint64_t alignment = huge_page_size;
+        void *mem = nullptr;
+#ifdef _WIN32
+        mem = _aligned_malloc(size, alignment);
+#else
+        if (posix_memalign(&mem, alignment, size)) {
+            mem = nullptr;
+        }
+#endif
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (mem && large_pages) {
+            madvise(mem, size, MADV_HUGEPAGE);
+        }
+#endif
+        table.tt = (Bucket*) mem;
+    }
+
+    if (!table.tt) {
+        std::cout << "info string Failed to allocate " << size / one_mb << " MB for the transposition table" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef __linux__
+    if (!interleave_nodes(table.tt, size)) {
+        std::cout << "info string Could not interleave the transposition table over NUMA nodes" << std::endl;
+    }
+#endif
+    return false;
+}
+
+void free_table() {
+    if (!table.tt) {
+        return;
+    }
+#ifndef _WIN32
+    if (table.memory == MEMORY_FILE) {
+        munmap(table.file_header, tt_file_header_size + table.tt_size);
+        table.tt = nullptr;
+        table.file_header = nullptr;
+        return;
+    }
+#endif
+#ifdef __linux__
+    if (table.memory != MEMORY_ALIGNED) {
+        munmap(table.tt, table.tt_size);
+        table.tt = nullptr;
+        return;
+    }
+#endif
+#ifdef _WIN32
+    _aligned_free(table.tt);
+#else
+    free(table.tt);
+#endif
+    table.tt = nullptr;
+}
+
+void clear_slice(int index, int count) {
+    uint64_t num_buckets = table.bucket_mask + 1;
+    uint64_t start = num_buckets * index / count;
+    uint64_t end = num_buckets * (index + 1) / count;
+    std::memset(&table.tt[start], 0, (end - start) * sizeof(Bucket));
+}
 
 void init_tt() {
-    table.tt_size = one_mb * 16ULL; // 16 MB
-    table.tt = (Bucket*) malloc(table.tt_size);
-    table.bucket_mask = (uint64_t)(table.tt_size / sizeof(Bucket) - 1);
-    table.generation = 0;
-    std::memset(table.tt, 0, table.tt_size);
-    // std::cout << sizeof(Bucket) << std::endl;
+    table.tt = nullptr;
+    reset_tt(16); // 16 MB
 }
 
 void clear_tt() {
-    std::memset(table.tt, 0, table.tt_size);
-    table.generation = 0;
+    // A single thread can't saturate the memory bandwidth, so large tables
+    // are cleared by all search threads in parallel
+    int count = table.tt_size >= 256 * one_mb ? num_threads : 1;
+    run_on_threads(count, [count](int index) { clear_slice(index, count); });
+    set_generation(0);
+    clear_tt_stats();
 }
 
 void reset_tt(int megabytes) {
+    free_table();
     table.tt_size = one_mb * (uint64_t) (megabytes);
-    table.tt = (Bucket*) realloc(table.tt, table.tt_size);
+    bool warm = alloc_table(table.tt_size);
     table.bucket_mask = (uint64_t)(table.tt_size / sizeof(Bucket) - 1);
-    clear_tt();
+    if (warm) {
+        table.generation = uint8_t(table.file_header->generation);
+        restore_occupancy();
+    } else {
+        clear_tt();
+        if (table.memory == MEMORY_FILE) {
+            fill_header(table.file_header);
+        }
+    }
+}
+
+bool save_tt(std::string path) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    char header[tt_file_header_size];
+    std::memset(header, 0, sizeof(header));
+    fill_header((TableHeader*) header);
+
+    bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+              fwrite(table.tt, 1, table.tt_size, file) == table.tt_size;
+    return fclose(file) == 0 && ok;
+}
+
+bool load_tt(std::string path) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    char header[tt_file_header_size];
+    TableHeader *table_header = (TableHeader*) header;
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || !valid_header(table_header)) {
+        fclose(file);
+        return false;
+    }
+
+    if (table_header->tt_size != table.tt_size) {
+        // Take over the size of the saved table, valid_header keeps it within the Hash option
+        int megabytes = int(table_header->tt_size / one_mb);
+        std::cout << "info string Resizing the hash to " << megabytes << " MB to match " << path << std::endl;
+        reset_tt(megabytes);
+    }
+
+    bool ok = fread(table.tt, 1, table.tt_size, file) == table.tt_size;
+    fclose(file);
+    if (!ok) {
+        clear_tt();
+        return false;
+    }
+
+    set_generation(uint8_t(table_header->generation));
+    restore_occupancy();
+    return true;
 }
 
 void start_search() {
-    table.generation = (table.generation + 1) % 64;
+    set_generation((table.generation + 1) % 64);
+
+    // Occupancy is counted from scratch for every generation, the other
+    // counters add up until ucinewgame or tt stats reset
+    clear_fresh_writes();
 }
 
 int score_to_tt(int score, uint16_t ply) {
@@ -69,11 +342,23 @@ int tt_to_score(int score, uint16_t ply) {
 }
 
 int hashfull() {
+    uint64_t fresh_writes = 0;
+    for (int i = 0; i < num_threads; ++i) {
+        fresh_writes += get_thread(i)->tt_stats.fresh_writes;
+    }
+    uint64_t entries = (table.bucket_mask + 1) * bucket_size;
+    return int(std::min(fresh_writes * 1000 / entries, uint64_t(1000)));
+}
+
+int hashfull_sampled() {
     int count = 0;
     for (uint64_t i = 0; i < table.bucket_mask; i += uint64_t(table.bucket_mask / 1000)) {
         Bucket *bucket = &table.tt[i];
         for (int j = 0; j < bucket_size; ++j) {
-            if (tte_age(&bucket->ttes[j]) == table.generation) {
+            uint64_t data = load_data(bucket, j);
+            TTEntry tte;
+            unpack_tte(data, &tte);
+            if (data && tte_age(&tte) == table.generation) {
                 ++count;
             }
         }
@@ -81,59 +366,155 @@ int hashfull() {
     return count / bucket_size;
 }
 
+void sum_tt_stats(TTStats *total) {
+    std::memset(total, 0, sizeof(TTStats));
+    for (int i = 0; i < num_threads; ++i) {
+        TTStats *stats = &get_thread(i)->tt_stats;
+        total->fresh_writes += stats->fresh_writes;
+        total->collisions += stats->collisions;
+        total->pawn_probes += stats->pawn_probes;
+        total->pawn_hits += stats->pawn_hits;
+        total->eval_probes += stats->eval_probes;
+        total->eval_hits += stats->eval_hits;
+        total->lazy_evals += stats->lazy_evals;
+        for (int s = 0; s < lazy_eval_stages; ++s) {
+            total->lazy_cuts[s] += stats->lazy_cuts[s];
+        }
+        for (int d = 0; d < tt_depth_bands; ++d) {
+            total->probes[d] += stats->probes[d];
+            total->hits[d] += stats->hits[d];
+            for (int a = 0; a < tt_age_bands; ++a) {
+                total->replacements[a][d] += stats->replacements[a][d];
+            }
+        }
+    }
+}
+
+void print_tt_stats() {
+    const char *depth_names[tt_depth_bands] = {"qsearch", "1-4", "5-8", "9-12", "13+"};
+    const char *age_names[tt_age_bands] = {"0", "1", "2", "3+"};
+
+    TTStats total;
+    sum_tt_stats(&total);
+
+    uint64_t probes = 0, hits = 0;
+    for (int d = 0; d < tt_depth_bands; ++d) {
+        probes += total.probes[d];
+        hits += total.hits[d];
+    }
+
+    std::cout << "Hashfull     : " << hashfull() << " (sampled " << hashfull_sampled() << ")" << std::endl;
+    std::cout << "Fresh writes : " << total.fresh_writes << std::endl;
+    std::cout << "Probes       : " << probes << ", hits " << hits << " (" << hits * 100 / (probes + 1) << "%)" << std::endl;
+    for (int d = 0; d < tt_depth_bands; ++d) {
+        std::cout << "  " << std::setw(10) << std::left << depth_names[d] << std::right << " : " << total.probes[d] << ", hits " << total.hits[d]
+                  << " (" << total.hits[d] * 100 / (total.probes[d] + 1) << "%)" << std::endl;
+    }
+    std::cout << "Collisions   : " << total.collisions << std::endl;
+    std::cout << "Pawn hash    : " << total.pawn_probes << ", hits " << total.pawn_hits << " (" << total.pawn_hits * 100 / (total.pawn_probes + 1) << "%)" << std::endl;
+    std::cout << "Eval cache   : " << total.eval_probes << ", hits " << total.eval_hits << " (" << total.eval_hits * 100 / (total.eval_probes + 1) << "%)" << std::endl;
+    std::cout << "Replacements by age (rows) and depth (columns) of the old entry" << std::endl;
+    std::cout << "       ";
+    for (int d = 0; d < tt_depth_bands; ++d) {
+        std::cout << std::setw(12) << depth_names[d];
+    }
+    std::cout << std::endl;
+    for (int a = 0; a < tt_age_bands; ++a) {
+        std::cout << "  " << std::setw(5) << std::left << age_names[a] << std::right;
+        for (int d = 0; d < tt_depth_bands; ++d) {
+            std::cout << std::setw(12) << total.replacements[a][d];
+        }
+        std::cout << std::endl;
+    }
+}
+
 int age_diff(TTEntry *tte) {
     return (table.generation - tte_age(tte)) & 0x3F;
 }
 
-void set_tte(uint64_t hash, TTEntry *tte, Move move, int depth, int score, int static_eval, uint8_t flag) {
+// Lowest value gets replaced. With six entries per bucket old entries stay
+// around longer, so a generation of age only weighs as much as 8 plies.
+int replace_value(TTEntry *tte) {
+    return tte->depth - age_diff(tte) * 8;
+}
+
+void set_tte(TTStats *stats, uint64_t hash, uint64_t *slot, Move move, int depth, int score, int static_eval, uint8_t flag) {
 #ifndef __TUNE__
+    Bucket *bucket = slot_bucket(slot);
+    int i = int(slot - bucket->data);
     uint16_t h = (uint16_t)(hash >> 48);
 
-    if (move || h != tte->hash) {
-        tte->move = move;
+    // The slot might have been overwritten since the probe, so read it again
+    uint64_t data = load_data(bucket, i);
+    bool same_hash = data && tte_hash(load_key(bucket, i), data) == h;
+    TTEntry tte;
+    unpack_tte(data, &tte);
+    bool fresh = !data || tte_age(&tte) != table.generation;
+
+    if (data && !same_hash) {
+        int age = std::min(age_diff(&tte), tt_age_bands - 1);
+        ++stats->replacements[age][depth_band(tte.depth)];
     }
 
-    if (h != tte->hash || depth > tte->depth - 4) {
+    if (move || !same_hash) {
+        tte.move = move;
+    }
+
+    if (!same_hash || depth > tte.depth - 4) {
         assert(depth < 256 && depth > -256);
-        tte->hash = h;
-        tte->depth = (int8_t)depth;
-        tte->score = (int16_t)score;
-        tte->static_eval = (int16_t)static_eval;
-        tte->ageflag = (table.generation << 2) | flag;
+        tte.depth = (int8_t)depth;
+        tte.score = (int16_t)score;
+        tte.static_eval = (int16_t)static_eval;
+        tte.ageflag = (table.generation << 2) | flag;
+        stats->fresh_writes += fresh;
     }
+
+    data = pack_tte(&tte);
+    __atomic_store_n(&bucket->data[i], data, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->keys[i], tte_key(hash, data), __ATOMIC_RELAXED);
 #endif
 }
 
-TTEntry *get_tte(uint64_t hash, bool &tt_hit) {
+uint64_t *get_tte(TTStats *stats, uint64_t hash, int depth, TTEntry &tte, bool &tt_hit) {
 #ifndef __TUNE__
     uint64_t index = hash & table.bucket_mask;
     Bucket *bucket = &table.tt[index];
+    int band = depth_band(depth);
+    ++stats->probes[band];
 
     uint16_t h = (uint16_t)(hash >> 48);
+    TTEntry entries[bucket_size];
     for (int i = 0; i < bucket_size; ++i) {
-        if (!bucket->ttes[i].hash) {
+        uint64_t data = load_data(bucket, i);
+        if (!data) {
+            std::memset(&tte, 0, sizeof(TTEntry));
             tt_hit = false;
-            return &bucket->ttes[i];
+            return &bucket->data[i];
         }
-        if (bucket->ttes[i].hash == h) {
+        if (tte_hash(load_key(bucket, i), data) == h) {
+            unpack_tte(data, &tte);
+            ++stats->hits[band];
             tt_hit = true;
-            return &bucket->ttes[i];
+            return &bucket->data[i];
         }
+        unpack_tte(data, &entries[i]);
     }
 
-    TTEntry *replacement = &bucket->ttes[0];
+    int replacement = 0;
     for (int i = 1; i < bucket_size; ++i) {
-        if (bucket->ttes[i].depth - age_diff(&bucket->ttes[i]) * 16 < replacement->depth - age_diff(replacement) * 16) {
-            replacement = &bucket->ttes[i];
+        if (replace_value(&entries[i]) < replace_value(&entries[replacement])) {
+            replacement = i;
         }
     }
 
+    std::memset(&tte, 0, sizeof(TTEntry));
     tt_hit = false;
-    return replacement;
+    return &bucket->data[replacement];
 #else
-    Bucket *bucket = &table.tt[0];
+    (void) stats;
+    (void) depth;
+    std::memset(&tte, 0, sizeof(TTEntry));
     tt_hit = false;
-    return &bucket->ttes[0];
+    return &table.tt[0].data[0];
 #endif
 }
-
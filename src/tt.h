@@ -19,17 +19,23 @@
 #ifndef TT_H
 #define TT_H
 
+#include <cstring>
+#include <string>
+
 #include "data.h"
 
 void init_tt();
 void clear_tt();
 void reset_tt(int megabytes);
 
-const int bucket_size = 3;
+const int bucket_size = 6;
 const uint64_t one_mb = 1024ULL * 1024ULL;
+const uint64_t one_gb = 1024ULL * one_mb;
+const uint64_t huge_page_size = 2ULL * one_mb;
+const int max_tt_mb = 65536; // Upper bound of the Hash option
 
+// The contents of an entry, packed into a single 64 bit word in the table
 typedef struct TTEntry {
-    uint16_t hash;
     Move     move;
     int16_t  score;
     int16_t  static_eval;
@@ -37,18 +43,93 @@ typedef struct TTEntry {
     int8_t   depth;
 } TTEntry;
 
+static_assert(sizeof(TTEntry) == sizeof(uint64_t), "TTEntry must fit in a word");
+
+// Each key is the upper 16 bits of the hash xor'ed with the folded data word.
+// Both words are accessed without locks, so a reader that sees the key of one
+// write and the data of another fails the check instead of using a torn entry.
 typedef struct Bucket {
-    TTEntry ttes[bucket_size];
-    char padding[2]; // Totaling 32 bytes
+    uint64_t data[bucket_size];
+    uint16_t keys[bucket_size];
+    char padding[4]; // Totaling 64 bytes, a single cache line
 } Bucket;
 
+static_assert(sizeof(Bucket) == 64, "Buckets must fill exactly one cache line");
+
+enum TableMemory {
+    MEMORY_ALIGNED = 0, // posix_memalign, transparent huge pages through madvise
+    MEMORY_HUGETLB_2MB, // mmap backed by reserved 2 MB huge pages
+    MEMORY_HUGETLB_1GB, // mmap backed by reserved 1 GB huge pages
+    MEMORY_FILE         // shared mmap of the HashFile, right after its header
+};
+
+// Layout of saved and memory mapped tables: the header padded to a page,
+// followed by the raw buckets
+const char tt_file_magic[8] = {'D', 'F', 'C', 'H', 'H', 'A', 'S', 'H'};
+const uint32_t tt_file_version = 1;
+const uint64_t tt_file_header_size = 4096;
+
+typedef struct TableHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t bucket_bytes;
+    uint32_t bucket_entries;
+    uint32_t generation;
+    uint64_t tt_size;
+} TableHeader;
+
 typedef struct Table {
     Bucket *tt;
     uint8_t generation;
     uint64_t tt_size;
     uint64_t bucket_mask;
+    TableMemory memory;
+    TableHeader *file_header; // Only set for MEMORY_FILE
 } Table;
 
+extern Table table;
+extern bool large_pages;
+extern std::string hash_file;
+
+inline uint16_t fold_data(uint64_t data) {
+    return (uint16_t) (data ^ (data >> 16) ^ (data >> 32) ^ (data >> 48));
+}
+
+inline uint16_t tte_key(uint64_t hash, uint64_t data) {
+    return (uint16_t) (hash >> 48) ^ fold_data(data);
+}
+
+// Returns the upper 16 bits of the hash the slot was written for
+inline uint16_t tte_hash(uint16_t key, uint64_t data) {
+    return key ^ fold_data(data);
+}
+
+inline uint64_t load_data(Bucket *bucket, int i) {
+    return __atomic_load_n(&bucket->data[i], __ATOMIC_RELAXED);
+}
+
+inline uint16_t load_key(Bucket *bucket, int i) {
+    return __atomic_load_n(&bucket->keys[i], __ATOMIC_RELAXED);
+}
+
+inline uint64_t pack_tte(TTEntry *tte) {
+    uint64_t data;
+    std::memcpy(&data, tte, sizeof(uint64_t));
+    return data;
+}
+
+inline void unpack_tte(uint64_t data, TTEntry *tte) {
+    std::memcpy(tte, &data, sizeof(uint64_t));
+}
+
+inline Bucket *slot_bucket(uint64_t *slot) {
+    return (Bucket*) ((uintptr_t) slot & ~(uintptr_t) (sizeof(Bucket) - 1));
+}
+
+inline void prefetch_tt(uint64_t hash) {
+    __builtin_prefetch(&table.tt[hash & table.bucket_mask]);
+}
+
 inline uint8_t tte_flag(TTEntry *tte) {
     return (uint8_t) (tte->ageflag & 0x3);
 }
@@ -57,10 +138,20 @@ inline uint8_t tte_age(TTEntry *tte) {
     return (uint8_t) (tte->ageflag >> 2);
 }
 
+inline int depth_band(int depth) {
+    return depth <= 0 ? 0 : std::min((depth + 3) / 4, tt_depth_bands - 1);
+}
+
 int hashfull();
+int hashfull_sampled();
+void clear_tt_stats();
+void sum_tt_stats(TTStats *total);
+void print_tt_stats();
+bool save_tt(std::string path);
+bool load_tt(std::string path);
 void start_search();
-void set_tte(uint64_t hash, TTEntry *tte, Move m, int depth, int score, int static_eval, uint8_t flag);
-TTEntry *get_tte(uint64_t hash, bool &tt_hit);
+void set_tte(TTStats *stats, uint64_t hash, uint64_t *slot, Move m, int depth, int score, int static_eval, uint8_t flag);
+uint64_t *get_tte(TTStats *stats, uint64_t hash, int depth, TTEntry &tte, bool &tt_hit);
 
 int score_to_tt(int score, uint16_t ply);
 int tt_to_score(int score, uint16_t ply);
@@ -16,15 +16,16 @@
     along with Defenchess.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <sys/time.h>
-#include <thread>
 #include <vector>
 
 #include "data.h"
 #include "eval.h"
 #include "movegen.h"
+#include "nnue.h"
 #include "position.h"
 #include "search.h"
 #include "see.h"
@@ -39,6 +40,7 @@ using namespace std;
 
 vector<string> word_list;
 Position *root_position;
+bool infinite_search = false; // Set by go, the search runs until stop
 
 vector<string> split_words(string s) {
     vector <string> tmp;
@@ -76,28 +78,88 @@ Move uci2move(Position *p, string s) {
     return _movecast(from, to, type);
 }
 
+Move parse_move(Position *p, string s) {
+    // Long algebraic notation with an optional promotion piece
+    Move m = uci2move(p, s);
+    if (s.length() == 5) {
+        if (s[4] == 'n') {
+            m = _promoten(m);
+        } else if (s[4] == 'r') {
+            m = _promoter(m);
+        } else if (s[4] == 'b') {
+            m = _promoteb(m);
+        } else {
+            m = _promoteq(m);
+        }
+    }
+    return m;
+}
+
 bool word_equal(int index, string comparison_str) {
     if (word_list.size() > (unsigned) index)
         return word_list[index] == comparison_str;
     return false;
 }
 
+// Reads the number at index into value and caps it at max_value, a missing
+// word keeps the default. Anything that is not a number or below min_value
+// is refused.
+bool word_int(int index, int min_value, int max_value, int *value) {
+    if (word_list.size() <= (unsigned) index)
+        return true;
+    int parsed;
+    try {
+        parsed = stoi(word_list[index]);
+    } catch (const std::exception &) {
+        cout << "info string " << word_list[index] << " is not a number" << endl;
+        return false;
+    }
+    if (parsed < min_value) {
+        cout << "info string " << word_list[index] << " is below the minimum of " << min_value << endl;
+        return false;
+    }
+    *value = std::min(parsed, max_value);
+    return true;
+}
+
 void uci() {
     cout << "id name Defenchess 2.3 x64" << endl << "id author Can Cetin & Dogac Eldenk" << endl;
-    cout << "option name Hash type spin default 16 min 1 max 65536" << endl;
+    cout << "option name Hash type spin default 16 min 1 max " << max_tt_mb << endl;
+    cout << "option name PawnHash type spin default 1 min 1 max 256" << endl;
     cout << "option name Threads type spin default 1 min 1 max " << MAX_THREADS << endl;
     cout << "option name SyzygyPath type string default <empty>" << endl;
     cout << "option name MoveOverhead type spin default 100 min 0 max 5000" << endl;
     cout << "option name Ponder type check default false" << endl;
+    cout << "option name MultiPV type spin default 1 min 1 max " << MAX_MOVES << endl;
     cout << "option name UCI_Chess960 type check default false" << endl;
+    cout << "option name LargePages type check default true" << endl;
+    cout << "option name HashFile type string default <empty>" << endl;
+    cout << "option name SharedHistory type check default false" << endl;
+    cout << "option name Deterministic type check default false" << endl;
+    cout << "option name SMPSkip type combo default table var none var odd var table" << endl;
+#ifdef __NNUE__
+    cout << "option name EvalFile type string default <empty>" << endl;
+#endif
     cout << "uciok" << endl;
 }
 
 void perft() {
     if (word_equal(1, "test"))
         TEST_H::perft_test();
-    else {
-        uint64_t nodes = Perft(stoi(word_list[1]), root_position, true, is_checked(root_position));
+    else if (word_equal(2, "threads") && word_list.size() > 3) {
+        // perft <depth> threads <n> [hash <mb>]
+        int depth, threads, hash_mb = 64;
+        if (!word_int(1, 0, MAX_PLY, &depth) || !word_int(3, 1, MAX_THREADS, &threads) ||
+            (word_equal(4, "hash") && !word_int(5, 1, max_tt_mb, &hash_mb))) {
+            return;
+        }
+        parallel_perft(depth, threads, hash_mb, true);
+    } else if (word_list.size() > 1) {
+        int depth;
+        if (!word_int(1, 0, MAX_PLY, &depth)) {
+            return;
+        }
+        uint64_t nodes = Perft(depth, root_position, true, is_checked(root_position));
         std::cout << nodes << std::endl;
     }
 }
@@ -114,13 +176,12 @@ void debug() {
 }
 
 void quit() {
-    if (!is_searching) {
-        exit(EXIT_SUCCESS);
-    }
-
+    // Let a running search print its best move, then join the pool before exiting
     is_timeout = true;
     is_pondering = false;
-    quit_application = true;
+    wait_search();
+    destroy_threads();
+    exit(EXIT_SUCCESS);
 }
 
 void stop() {
@@ -133,8 +194,8 @@ void isready() {
 }
 
 void go() {
-    std::thread think_thread(think, root_position, word_list);
-    think_thread.detach();
+    infinite_search = std::find(word_list.begin(), word_list.end(), "infinite") != word_list.end();
+    launch_search(word_list);
 }
 
 void startpos() {
@@ -143,18 +204,8 @@ void startpos() {
     if (word_equal(2, "moves")) {
         for (unsigned i = 3 ; i < word_list.size() ; i++) {
             Move m = no_move;
-            if (word_list[i].length() == 4) {
-                m = uci2move(root_position, word_list[i]);
-            } else if (word_list[i].length() == 5) {
-                if (word_list[i][4] == 'n') {
-                    m = _promoten(uci2move(root_position, word_list[i]));
-                } else if (word_list[i][4] == 'r') {
-                    m = _promoter(uci2move(root_position, word_list[i]));
-                } else if (word_list[i][4] == 'b') {
-                    m = _promoteb(uci2move(root_position, word_list[i]));
-                } else {
-                    m = _promoteq(uci2move(root_position, word_list[i]));
-                }
+            if (word_list[i].length() == 4 || word_list[i].length() == 5) {
+                m = parse_move(root_position, word_list[i]);
             }
             if (m != no_move && is_pseudolegal(root_position, m)) {
                 make_move(root_position, m);
@@ -171,18 +222,8 @@ void cmd_fen() {
     if (word_equal(8, "moves")) {
         for (unsigned i = 9 ; i < word_list.size() ; i++) {
             Move m = no_move;
-            if (word_list[i].length() == 4) {
-                m = uci2move(root_position, word_list[i]);
-            } else if (word_list[i].length() == 5) {
-                if (word_list[i][4] == 'n') {
-                    m = _promoten(uci2move(root_position, word_list[i]));
-                } else if (word_list[i][4] == 'r') {
-                    m = _promoter(uci2move(root_position, word_list[i]));
-                } else if (word_list[i][4] == 'b') {
-                    m = _promoteb(uci2move(root_position, word_list[i]));
-                } else {
-                    m = _promoteq(uci2move(root_position, word_list[i]));
-                }
+            if (word_list[i].length() == 4 || word_list[i].length() == 5) {
+                m = parse_move(root_position, word_list[i]);
             }
             if (m != no_move && is_pseudolegal(root_position, m)) {
                 make_move(root_position, m);
@@ -205,6 +246,33 @@ void undo() {
     undo_test(root_position, move);
 }
 
+void cmd_tt() {
+    if (word_equal(1, "stress")) {
+        int threads = 256;
+        if (word_int(2, 1, MAX_THREADS, &threads)) {
+            tt_stress_test(threads);
+        }
+    } else if (word_equal(1, "stats")) {
+        if (word_equal(2, "reset")) {
+            clear_tt_stats();
+        } else {
+            print_tt_stats();
+        }
+    } else if (word_equal(1, "save") && word_list.size() > 2) {
+        struct timeval start, end;
+        gettimeofday(&start, nullptr);
+        bool ok = save_tt(word_list[2]);
+        gettimeofday(&end, nullptr);
+        cout << "info string " << (ok ? "Saved " : "Failed to save ") << word_list[2] << " in " << bench_time(start, end) << " ms" << endl;
+    } else if (word_equal(1, "load") && word_list.size() > 2) {
+        struct timeval start, end;
+        gettimeofday(&start, nullptr);
+        bool ok = load_tt(word_list[2]);
+        gettimeofday(&end, nullptr);
+        cout << "info string " << (ok ? "Loaded " : "Failed to load ") << word_list[2] << " in " << bench_time(start, end) << " ms" << endl;
+    }
+}
+
 void cmd_position() {
     if (word_list[1] == "fen") 
         cmd_fen();
@@ -220,14 +288,40 @@ void option(string name, string value) {
             cout << "info Hash value needs to be a power of 2!" << endl;
         }
         reset_tt(mb);
+    } else if (name == "PawnHash") {
+        reset_pawntt(std::min(256, std::max(1, stoi(value))));
     } else if (name == "Threads") {
         reset_threads(std::min(MAX_THREADS, std::max(1, stoi(value))));
     } else if (name == "SyzygyPath") {
         init_syzygy(value);
     } else if (name == "MoveOverhead") {
         move_overhead = stoi(value);
+    } else if (name == "MultiPV") {
+        multi_pv = std::min(MAX_MOVES, std::max(1, stoi(value)));
     } else if (name == "UCI_Chess960") {
         chess960 = value == "true";
+    } else if (name == "LargePages") {
+        large_pages = value == "true";
+        reset_tt(int(table.tt_size / one_mb));
+    } else if (name == "SharedHistory") {
+        set_shared_history(value == "true");
+    } else if (name == "Deterministic") {
+        deterministic = value == "true";
+    } else if (name == "SMPSkip") {
+        smp_skip = value == "none" ? SKIP_NONE : value == "odd" ? SKIP_ODD : SKIP_TABLE;
+#ifdef __NNUE__
+    } else if (name == "EvalFile") {
+        if (value == "<empty>") {
+            use_nnue = false;
+        } else if (load_nnue(value)) {
+            nnue_refresh(root_position);
+        }
+        // Cached evaluations came from the previous evaluator
+        clear_threads();
+#endif
+    } else if (name == "HashFile") {
+        hash_file = value == "<empty>" ? "" : value;
+        reset_tt(int(table.tt_size / one_mb));
     }
 }
 
@@ -247,20 +341,75 @@ void so() {
     option(name, value);
 }
 
+void cmd_bench() {
+    // bench [depth] [threads] [hash] [fenfile] [out.json|out.csv], "default" keeps the built in positions
+    if (word_equal(1, "largepages")) {
+        bench_large_pages();
+        return;
+    }
+    // Zero threads or hash keeps the current setting
+    int depth = 13, threads = 0, hash = 0;
+    if (!word_int(1, 1, MAX_PLY, &depth) || !word_int(2, 0, MAX_THREADS, &threads) || !word_int(3, 0, max_tt_mb, &hash)) {
+        return;
+    }
+    string fen_file = word_list.size() > 4 && word_list[4] != "default" ? word_list[4] : "";
+    string out_file = word_list.size() > 5 ? word_list[5] : "";
+    bench(depth, threads, hash, fen_file, out_file);
+}
+
+void bench_args(std::vector<std::string> args) {
+    // Command line bench, args starts with "bench" like the uci command
+    word_list = args;
+    cmd_bench();
+}
+
+void cmd_smpbench() {
+    if (word_equal(1, "scaling")) {
+        int depth = 12, positions = 8;
+        if (word_int(2, 1, MAX_PLY, &depth) && word_int(3, 1, 36, &positions)) {
+            smp_scaling_bench(depth, positions);
+        }
+        return;
+    }
+    int depth = 12, positions = 8;
+    if (word_int(1, 1, MAX_PLY, &depth) && word_int(2, 1, 36, &positions)) {
+        smp_bench(depth, positions);
+    }
+}
+
 void ucinewgame() {
     clear_threads();
     clear_tt();
 }
 
 void eval() {
-    cout << evaluate(root_position) << endl;
+    if (word_equal(1, "stats")) {
+        print_eval_stats();
+    } else {
+        cout << evaluate(root_position) << endl;
+    }
 }
 
 void ponderhit() {
     is_pondering = false;
 }
 
+bool runs_during_search(string s) {
+    return s == "stop" || s == "ponderhit" || s == "isready" || s == "uci" || s == "quit" || s == "exit";
+}
+
 void run_command(string s) {
+    // The search reads the position, threads and tables, so anything that
+    // touches them waits until the best move is out. An infinite or ponder
+    // search only ends on stop, waiting for it would keep stop from being read.
+    if (!runs_during_search(s)) {
+        if (search_active && !is_timeout && (infinite_search || is_pondering)) {
+            cout << "info string Ignoring " << s << " during an infinite or ponder search" << endl;
+            return;
+        }
+        wait_search();
+    }
+
     if (s == "ucinewgame")
         ucinewgame();
     if (s == "position")
@@ -286,9 +435,13 @@ void run_command(string s) {
     if (s == "see")
         see();
     if (s == "bench")
-        bench();
+        cmd_bench();
+    if (s == "smpbench")
+        cmd_smpbench();
     if (s == "undo")
         undo();
+    if (s == "tt")
+        cmd_tt();
     if (s == "eval")
         eval();
     if (s == "ponderhit")
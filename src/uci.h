@@ -19,10 +19,15 @@
 #ifndef UCI_H
 #define UCI_H
 
+#include <string>
+#include <vector>
+
 #include "const.h"
 
 void loop();
+void bench_args(std::vector<std::string> args);
 
-Move uci2move (Position *p, char* s);
+Move uci2move(Position *p, std::string s);
+Move parse_move(Position *p, std::string s);
 
 #endif